@@ -32,6 +32,24 @@
 #include "SDL\include\SDL.h"
 #include "SDL_image\include\SDL_image.h"
 #include "SDL_mixer\include\SDL_mixer.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 // Globals for design tweaks -------------------------------------
 #define SCROLL_SPEED 2
@@ -46,414 +64,3078 @@
 #define SHOT_TIMER 300u // ms between each shot
 #define INTRO_FREE_TIMER 1000u // ms of invulnerability and control for the player
 
-// Globals for tech tweaks -------------------------------------
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 480
-#define SPRITE_SIZE 64
-#define EXPLOSION_SPEED 20 // in frames, we should be at 60/second cos of vsync
-#define NUM_EXPLOSIONS NUM_ENEMIES + 1
-#define NUM_LAYERS 5
-#define ASSETS_DIR "assets/"
+// Globals for tech tweaks -------------------------------------
+#define SCREEN_WIDTH 640
+#define SCREEN_HEIGHT 480
+#define SPRITE_SIZE 64
+#define EXPLOSION_SPEED 20 // in simulation ticks
+#define NUM_EXPLOSIONS (NUM_ENEMIES + 1)
+#define NUM_LAYERS 5
+#define ASSETS_DIR "assets/"
+#define GRID_X (-SPRITE_SIZE * 2) // collision grid covers a margin around the screen,
+#define GRID_Y (-SPRITE_SIZE) // anything further away lands on the border cells
+#define GRID_W ((SCREEN_WIDTH + SPRITE_SIZE * 4) / SPRITE_SIZE)
+#define GRID_H ((SCREEN_HEIGHT + SPRITE_SIZE * 2 + SPRITE_SIZE - 1) / SPRITE_SIZE)
+#define SIM_HZ 60 // fixed simulation ticks per second, whatever the display refresh is
+#define MAX_SIM_STEPS 8 // max ticks to catch up in one frame, avoids spiraling when we are too slow
+#define HEADLESS_TICKS (SIM_HZ * 60 * 60) // default ticks to run with -headless (one hour of game time)
+#define MAX_WORKERS 63 // max threads in the worker pool, main thread also works
+#define WORLDS_PER_JOB 16 // worlds stepped by a worker before grabbing more
+#define TAPE_MAGIC "QSSR" // header of input recordings
+#define TAPE_VERSION 1
+#define PACK_FILE ASSETS_DIR "assets.pak" // textures baked with -pack, used instead of the png files when present
+#define PACK_MAGIC "QSSP"
+#define PACK_VERSION 2
+#define PACK_FORMAT SDL_PIXELFORMAT_ARGB8888 // native format of the renderers we use
+#define PACK_NAME_SIZE 48
+#define PACK_ALIGN 16
+#define MAX_ASSETS 32
+#define SIMD_WIDTH 4 // entities moved at once by the kernels (SSE2 has 4 ints per register)
+#define PROFILER 1 // 0 compiles all profiler zones out
+#define PROFILER_EVENTS 16384 // zones kept per thread, oldest ones get overwritten
+#define PROFILER_THREADS (MAX_WORKERS + 2)
+#define AUDIO_FREQUENCY 44100
+#define AUDIO_BUFFER 2048 // samples per mix, -audio-buffer picks a smaller one for less latency
+#define AUDIO_COMMANDS 64 // sounds queued for the mixer before it drains them, power of two
+#define MAX_VOICES 8 // sound effects playing at once, same as SDL_mixer channels
+#define LATENCY_SHOTS 10 // lasers fired by -latency-test, one every LATENCY_INTERVAL
+#define LATENCY_INTERVAL 1000u // ms
+#define LATENCY_START 4000u // ms, once the ship is free to shoot
+#define LATENCY_THRESHOLD 4096 // microphone level that counts as hearing the laser
+#define MAX_RENDER_COMMANDS 1024 // copies recorded per frame, a frame uses less than a hundred
+#define TILE_W 128 // software renderer splits the screen in tiles drawn in parallel
+#define TILE_H 32
+#define TILES_X ((SCREEN_WIDTH + TILE_W - 1) / TILE_W)
+#define TILES_Y ((SCREEN_HEIGHT + TILE_H - 1) / TILE_H)
+#define NUM_TILES (TILES_X * TILES_Y)
+#define TIMER_LEVELS 3 // timer wheel covers 64^3 ticks (more than an hour), further timers wait in the last level
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS) // per level, a slot of a level spans all the slots of the one below
+#define MAX_TIMERS (NUM_EXPLOSIONS + 3) // one per explosion plus wave, fire cooldown and ship
+#define MAX_EVENTS (NUM_ENEMIES + 2) // per tick: every enemy killed, a shot and the ship hit
+
+// Macros --------------------------------------------------------
+#define CAP(value, min, max) (value = (value<min) ? min : ((value>max) ? max : value));
+#define MS_TO_TICKS(ms) ((ms) * SIM_HZ / 1000u)
+#define PADDED(count) (((count) + SIMD_WIDTH - 1) & ~(SIMD_WIDTH - 1))
+#define ALIVE_WORDS(count) (((count) + 31) / 32)
+#define MAX_POOL_SIZE 65536 // pools index slots with Uint16
+#define ASSET_INDEX(handle) int((handle) & 0xffff)
+#define ASSET_GENERATION(handle) Uint16((handle) >> 16)
+#define PROFILE_JOIN(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_JOIN(profile_zone_, line)
+#if PROFILER
+#define PROFILE(name) profile_zone PROFILE_NAME(__LINE__)(name) // times the rest of the scope
+#else
+#define PROFILE(name)
+#endif
+
+const char* tex_layers[NUM_LAYERS] = { 
+	ASSETS_DIR "bg0.png", ASSETS_DIR "bg1.png", ASSETS_DIR "bg2.png", ASSETS_DIR "bg3.png", ASSETS_DIR "fg.png" };
+const char* tex_atlas = ASSETS_DIR "atlas.png";
+
+// How fast each layer scrolls compared to SCROLL_SPEED, 0 is a static layer --
+const int layer_speeds[NUM_LAYERS] = { 0, 1, 2, 3, 4 };
+
+// Enemies wave up and down with int(sinf(x / 32) * 4), x goes from SCREEN_WIDTH to -SPRITE_SIZE
+// so we bake that range at compile time. Series only for the first x and the step, then every
+// x rotates the sin/cos of the previous one, cheap enough for the compiler's constexpr step
+// budget (/constexpr:steps in MSVC). Checked to match sinf() for every x in range: the closest
+// value to a rounding edge is 1e-5 away, the rotations drift less than 1e-12 --
+#define WAVE_MIN_X (-SPRITE_SIZE)
+#define WAVE_MAX_X SCREEN_WIDTH
+
+// 12 terms once x is folded into [-pi, pi], error under 1e-10
+constexpr double ConstSin(double x)
+{
+	const double pi = 3.14159265358979323846;
+	while (x > pi)
+		x -= 2 * pi;
+	while (x < -pi)
+		x += 2 * pi;
+
+	double term = x, sum = x;
+	for (int n = 1; n < 12; ++n)
+	{
+		term *= -x * x / ((2 * n) * (2 * n + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+constexpr double ConstCos(double x)
+{
+	return ConstSin(x + 1.57079632679489661923);
+}
+
+struct wave_table
+{
+	Sint8 dy[WAVE_MAX_X - WAVE_MIN_X + 1];
+};
+
+constexpr wave_table MakeWaveTable()
+{
+	const double step = 1.0 / (SCREEN_WIDTH/20);
+	const double step_sin = ConstSin(step), step_cos = ConstCos(step);
+	double wave_sin = ConstSin(WAVE_MIN_X * step), wave_cos = ConstCos(WAVE_MIN_X * step);
+
+	wave_table t = {};
+	for (int x = WAVE_MIN_X; x <= WAVE_MAX_X; ++x)
+	{
+		t.dy[x - WAVE_MIN_X] = Sint8(wave_sin * 4);
+		double next = wave_sin * step_cos + wave_cos * step_sin; // sin(a + b)
+		wave_cos = wave_cos * step_cos - wave_sin * step_sin; // cos(a + b)
+		wave_sin = next;
+	}
+	return t;
+}
+
+constexpr wave_table enemy_wave = MakeWaveTable();
+
+// All sprites come from a single texture, this is where each one is --
+enum sprite_id
+{
+	SPRITE_SHIP,
+	SPRITE_SHOT,
+	SPRITE_ENEMY,
+	SPRITE_EXPLOSION,
+	SPRITE_MAX,
+	SPRITE_FONT,
+	NUM_SPRITES
+};
+
+struct sprite_region
+{
+	SDL_Rect rect;
+	SDL_RendererFlip flip; // ship and shot face left in the atlas
+};
+
+const sprite_region atlas_regions[NUM_SPRITES] = {
+	{ { 757, 308, 32, 32 }, SDL_FLIP_HORIZONTAL }, // ship
+	{ { 724, 500, 32, 32 }, SDL_FLIP_HORIZONTAL }, // shot
+	{ { 789, 339, 32, 32 }, SDL_FLIP_NONE }, // enemy
+	{ { 591, 928, 384, 64 }, SDL_FLIP_NONE }, // explosion, 6 frames of 64x64
+	{ { 765, 654, 79, 27 }, SDL_FLIP_NONE }, // "MAX" label
+	{ { 702, 569, 240, 27 }, SDL_FLIP_NONE } // font, "0123456789"
+};
+
+// Slots for N entities: O(1) acquire and release from a stack of free
+// slots, a dense list of live ones and a bitmask of alive ones
+template <int N>
+struct slot_pool
+{
+	int num_live, num_free;
+	Uint16 live[N];
+	Uint16 where[N]; // position of each live slot in the live list
+	Uint16 free[N];
+	Uint32 alive[ALIVE_WORDS(PADDED(N))];
+};
+
+// Entities are stored as one array per field plus a pool of slots,
+// arrays are padded so kernels can always work on SIMD_WIDTH at a time
+struct explosion_array
+{
+	unsigned expire[PADDED(NUM_EXPLOSIONS)]; // last tick it is shown
+	int x[PADDED(NUM_EXPLOSIONS)], y[PADDED(NUM_EXPLOSIONS)];
+	int prev_x[PADDED(NUM_EXPLOSIONS)], prev_y[PADDED(NUM_EXPLOSIONS)];
+	slot_pool<NUM_EXPLOSIONS> pool;
+};
+
+struct enemy_array
+{
+	int x[PADDED(NUM_ENEMIES)], y[PADDED(NUM_ENEMIES)];
+	int prev_x[PADDED(NUM_ENEMIES)], prev_y[PADDED(NUM_ENEMIES)];
+	slot_pool<NUM_ENEMIES> pool;
+};
+
+// Enemies bucketed in SPRITE_SIZE cells, rebuilt every tick after they move
+struct enemy_grid
+{
+	int start[GRID_W * GRID_H + 1]; // where each cell begins in items
+	Uint16 items[NUM_ENEMIES];
+	Uint16 cell[NUM_ENEMIES]; // cell of each enemy slot
+};
+
+typedef Uint32 asset_handle; // slot index in the low 16 bits, slot generation in the high ones, 0 is no asset
+
+struct parallax
+{
+	int width, height;
+	int speed; // multiplies scroll, 0 never moves
+	asset_handle texture;
+};
+
+struct projectile_array
+{
+	int x[PADDED(NUM_SHOTS)], y[PADDED(NUM_SHOTS)];
+	int prev_x[PADDED(NUM_SHOTS)], prev_y[PADDED(NUM_SHOTS)];
+	slot_pool<NUM_SHOTS> pool;
+};
+
+// Things that happen during a tick, their side effects (score, explosions, sounds) are applied
+// all together once the tick is simulated --
+enum event_type
+{
+	EVENT_SHOT, // laser fired
+	EVENT_KILL, // enemy shot down at x, y
+	EVENT_CRASH, // enemy crashed against the ship at x, y
+	EVENT_HIT // ship hit at x, y
+};
+
+struct game_event
+{
+	event_type type;
+	int x, y;
+};
+
+// Sounds to play after a tick, each one once however many times it happened
+enum sound_bits
+{
+	SOUND_SHOOT = 1 << 0,
+	SOUND_EXPLOSION = 1 << 1
+};
+
+struct world;
+typedef void (*timer_callback)(world* w, int data);
+
+// Hierarchical timer wheel: timers due in the next TIMER_SLOTS ticks wait in the slot of their tick,
+// later ones in a coarser level until they get close enough. A tick only looks at what is due --
+struct timer_wheel
+{
+	Sint16 head[TIMER_LEVELS * TIMER_SLOTS], tail[TIMER_LEVELS * TIMER_SLOTS]; // -1 when empty
+	Sint16 next[MAX_TIMERS], prev[MAX_TIMERS];
+	Sint16 list[MAX_TIMERS]; // level * TIMER_SLOTS + slot each timer is linked in
+	unsigned due[MAX_TIMERS]; // tick at the end of which it fires
+	timer_callback callback[MAX_TIMERS];
+	int data[MAX_TIMERS];
+	slot_pool<MAX_TIMERS> pool;
+};
+
+// All simulation state, so we can run as many worlds as we want
+struct world
+{
+	int ship_x, ship_y;
+	int prev_ship_x, prev_ship_y;
+	int wave_count; // enemies spawned in current wave
+	int last_enemy; // slot of the last one spawned
+	int fire, up, down, left, right;
+	int scroll, prev_scroll;
+	int score, max_score;
+	int spawn_height;
+	unsigned tick; // the only clock the simulation knows about
+	bool spawning; // wave started, enemies come out one after the other
+	bool can_fire; // laser cooled down
+	bool intro, invulnerable, controls; // ship flying in, can't be hit, moved by the player
+	int ship_timer; // pending timer of the ship, -1 for none
+	timer_wheel timers;
+	game_event events[MAX_EVENTS]; // of the tick being simulated
+	int num_events;
+	Uint32 sounds; // sound_bits of the last tick
+	projectile_array shots;
+	enemy_array enemies;
+	explosion_array explosions;
+	enemy_grid grid;
+};
+
+// What Draw() needs from a world, copied after every batch of ticks so the simulation
+// can go on with the next one while this is rendered --
+struct sprite_state
+{
+	int x, y;
+	int prev_x, prev_y;
+	int frame; // animation frame, explosions only
+};
+
+struct world_snapshot
+{
+	int ship_x, ship_y;
+	int prev_ship_x, prev_ship_y;
+	bool ship_blinking;
+	int scroll, prev_scroll;
+	int score, max_score;
+	int num_shots, num_enemies, num_explosions;
+	sprite_state shots[NUM_SHOTS];
+	sprite_state enemies[NUM_ENEMIES];
+	sprite_state explosions[NUM_EXPLOSIONS];
+	float alpha; // interpolation from previous to current positions
+};
+
+// Input bits for every tick, this is what we record and replay
+enum input_bits
+{
+	INPUT_UP = 1 << 0,
+	INPUT_DOWN = 1 << 1,
+	INPUT_LEFT = 1 << 2,
+	INPUT_RIGHT = 1 << 3,
+	INPUT_FIRE = 1 << 4,
+	INPUT_QUIT = 1 << 5
+};
+
+// Recorded input: header then runs of (mask byte, varint count of ticks)
+struct input_tape
+{
+	Uint8* data;
+	int size, capacity;
+	Uint8 mask; // run being recorded
+	unsigned run;
+};
+
+// Many worlds can replay the same tape, each one with its own reader
+struct tape_reader
+{
+	const input_tape* tape;
+	int pos;
+	Uint8 mask;
+	unsigned left; // ticks left in current run
+};
+
+// Premultiplied ARGB pixels kept in memory for the software renderer
+struct soft_image
+{
+	Uint32* pixels; // width pixels per row
+	int width, height;
+	bool opaque; // no pixel below full alpha, rows are copied as they are
+};
+
+// Copies are recorded during Draw() and sent to the renderer at the end of the frame,
+// by depth first and grouped by texture inside the same depth --
+enum draw_depth
+{
+	DEPTH_IMMEDIATE = -1, // not recorded, straight to the renderer (drawing into the HUD texture)
+	DEPTH_LAYERS = 0, // one per parallax layer
+	DEPTH_SHIP = DEPTH_LAYERS + NUM_LAYERS,
+	DEPTH_LASERS,
+	DEPTH_ENEMIES,
+	DEPTH_EXPLOSIONS,
+	DEPTH_HUD
+};
+
+struct render_command
+{
+	SDL_Texture* texture;
+	const soft_image* image; // software renderer draws this instead of texture
+	SDL_Rect source; // w == 0 for the whole texture
+	SDL_Rect target;
+	SDL_RendererFlip flip;
+	int depth;
+	int order; // recording order, keeps the sort stable
+};
+
+struct render_buffer
+{
+	render_command commands[MAX_RENDER_COMMANDS];
+	int count;
+	int dropped;
+};
+
+// Commands touching each screen tile, in drawing order
+struct tile_bins
+{
+	int count[NUM_TILES];
+	Uint16 commands[NUM_TILES][MAX_RENDER_COMMANDS];
+};
+
+// Keyboard state gathered by the main thread, handed to the simulation before each batch
+struct input_state
+{
+	Uint8 held; // INPUT_* of keys down right now
+	bool fire_pressed; // fire went down (or repeated) since last hand off
+};
+
+// Runs the ticks of next frame on its own thread while the main one draws this frame --
+struct sim_thread
+{
+	SDL_Thread* thread;
+	SDL_mutex* lock;
+	SDL_cond* wake;
+	SDL_cond* done;
+	bool busy; // a batch is running, only the simulation touches g.game and the back snapshot
+	bool quit;
+	bool finished; // replay ran out of input
+	int steps; // ticks in current batch
+	input_state input;
+	tape_reader* replay;
+	input_tape* record;
+	world_snapshot snapshots[2];
+	int front; // snapshot being drawn, the other one is written by the simulation
+};
+
+// Pool of threads running a batch of jobs in parallel
+struct job_pool
+{
+	SDL_Thread* threads[MAX_WORKERS];
+	int num_threads;
+	SDL_mutex* lock;
+	SDL_cond* wake;
+	SDL_cond* idle;
+	void (*job)(void* data, int index);
+	void* data;
+	int count;
+	int busy; // workers not done with current batch yet
+	unsigned batch; // bumped for every batch so workers know there is new work
+	bool quit;
+	SDL_atomic_t next; // next job index to grab
+};
+
+// Zones recorded by one thread, only that thread writes to it
+struct profile_event
+{
+	const char* name;
+	Uint64 start, end; // end is 0 for counters
+	int value;
+};
+
+struct profile_ring
+{
+	profile_event events[PROFILER_EVENTS];
+	SDL_atomic_t count; // events ever written, published after each write
+	int thread;
+};
+
+struct profile_state
+{
+	bool enabled;
+	const char* file;
+	Uint64 start;
+	profile_ring* rings[PROFILER_THREADS];
+	SDL_atomic_t num_rings;
+};
+
+// Archive of raw pixels: header, index and then each texture, all mapped in memory at once --
+struct pack_header
+{
+	char magic[4];
+	Uint32 version;
+	Uint32 format;
+	Uint32 num_entries;
+};
+
+struct pack_entry
+{
+	char name[PACK_NAME_SIZE]; // same path the png is loaded from
+	Uint32 width, height, pitch;
+	Uint32 offset; // from the start of the archive
+	Uint64 source_size, source_time; // of the png when packed, the entry is stale once they change
+};
+
+struct asset_pack
+{
+	const Uint8* data;
+	size_t size;
+	const pack_entry* entries;
+	int num_entries;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+};
+
+// Everything loaded from disk, shared by file name and freed when nobody references it --
+enum asset_kind { ASSET_IMAGE, ASSET_MUSIC, ASSET_WAV };
+
+struct asset
+{
+	asset_kind kind;
+	const char* file; // null for free slots
+	Uint16 generation; // bumped when freed so old handles stop working
+	int refs;
+	bool loaded;
+	const pack_entry* packed; // while loading: already decoded, nothing to do for the job
+	SDL_Surface* surface; // while loading: decoded pixels, freed once uploaded
+	SDL_Texture* texture;
+	soft_image image; // software renderer only, instead of texture
+	Mix_Music* music;
+	Mix_Chunk* chunk;
+	int width, height;
+	size_t decode_bytes; // freed after upload
+	size_t cpu_bytes, gpu_bytes; // resident while loaded
+};
+
+struct asset_manager
+{
+	asset slots[MAX_ASSETS];
+};
+
+// Sound effects are mixed by us in the SDL_mixer post mix hook, the game only queues them in a
+// single producer / single consumer ring so it never waits on the audio device lock --
+struct audio_command
+{
+	const Mix_Chunk* chunk;
+	int volume; // 0 to MIX_MAX_VOLUME
+};
+
+struct audio_voice
+{
+	const Sint16* samples; // nullptr when free
+	int left; // samples still to mix, both channels
+	int volume;
+};
+
+struct audio_mixer
+{
+	bool hooked; // device is 16 bit stereo and we mix, otherwise sounds go through Mix_PlayChannel
+	audio_command commands[AUDIO_COMMANDS];
+	SDL_atomic_t written, read; // commands ever written (only by the game) and read (only by the mixer)
+	int dropped; // ring was full, game side
+	int samples; // asked for when opening the device, it may use another size
+	int frequency, frame_bytes; // of the device, a frame has a sample of every channel
+	audio_voice voices[MAX_VOICES]; // audio thread only from here
+	Uint64 last_mix; // performance counter at the start of the last callback
+	Uint64 longest; // gap between callbacks
+	int callbacks, underruns; // late callbacks, the device probably ran dry
+};
+
+// Fires lasers by itself and times until the microphone hears them, speakers need to be on --
+struct latency_test
+{
+	bool enabled;
+	SDL_AudioDeviceID capture;
+	int frequency;
+	Uint64 next_press, release; // main thread only
+	Uint64 press; // waiting for the simulation to fire the laser, 0 when none. Main thread while the sim waits
+	Uint64 pressed; // laser fired, waiting to hear it. Shared with the capture callback under the device lock
+	int presses, fired, heard;
+	double ms[LATENCY_SHOTS];
+};
+
+// Data for the decode jobs
+struct load_batch
+{
+	asset* pending[MAX_ASSETS];
+	const asset_pack* pack;
+};
+
+struct globals
+{
+	bool headless;
+	int frame;
+	job_pool pool;
+	sim_thread sim;
+	input_tape tape;
+	profile_state profiler;
+	SDL_Window* window;
+	SDL_Renderer* renderer;
+	bool software; // draw into our own framebuffer, SDL only presents it
+	struct
+	{
+		Uint32* pixels; // SCREEN_WIDTH x SCREEN_HEIGHT
+		SDL_Texture* screen;
+		tile_bins bins;
+	} soft;
+	asset_manager assets;
+	asset_handle atlas;
+	asset_handle music;
+	asset_handle fx_shoot;
+	asset_handle fx_explosion;
+	audio_mixer audio;
+	latency_test latency;
+	struct
+	{
+		int w, h;
+		SDL_Rect glyphs[128]; // atlas section of every ascii char, w == 0 when the font does not have it
+	} font;
+	render_buffer render;
+	struct
+	{
+		int submitted, culled; // sprites this frame
+		Uint64 total_submitted, total_culled;
+	} sprites;
+	struct
+	{
+		SDL_Texture* texture; // score and labels, drawn again only when a number changes
+		SDL_Rect target;
+		int score, max_score;
+		bool valid;
+	} hud;
+	parallax layers[NUM_LAYERS];
+	world game; // the world we play and draw
+} g; // automatically create an insteance called "g"
+
+// ----------------------------------------------------------------
+void RunPendingJobs(job_pool* p)
+{
+	int index;
+	while ((index = SDL_AtomicAdd(&p->next, 1)) < p->count)
+		p->job(p->data, index);
+}
+
+int PoolWorker(void* data)
+{
+	job_pool* p = (job_pool*)data;
+	unsigned batch = 0;
+
+	SDL_LockMutex(p->lock);
+	for (;;)
+	{
+		while (p->quit == false && p->batch == batch)
+			SDL_CondWait(p->wake, p->lock);
+
+		if (p->quit)
+			break;
+
+		batch = p->batch;
+		SDL_UnlockMutex(p->lock);
+		RunPendingJobs(p);
+		SDL_LockMutex(p->lock);
+
+		if (--p->busy == 0)
+			SDL_CondSignal(p->idle);
+	}
+	SDL_UnlockMutex(p->lock);
+
+	return 0;
+}
+
+void StartPool(job_pool* p)
+{
+	p->num_threads = SDL_GetCPUCount() - 1;
+	CAP(p->num_threads, 0, MAX_WORKERS);
+	p->lock = SDL_CreateMutex();
+	p->wake = SDL_CreateCond();
+	p->idle = SDL_CreateCond();
+
+	for (int i = 0; i < p->num_threads; ++i)
+		p->threads[i] = SDL_CreateThread(PoolWorker, "worker", p);
+}
+
+void StopPool(job_pool* p)
+{
+	SDL_LockMutex(p->lock);
+	p->quit = true;
+	SDL_CondBroadcast(p->wake);
+	SDL_UnlockMutex(p->lock);
+
+	for (int i = 0; i < p->num_threads; ++i)
+		SDL_WaitThread(p->threads[i], nullptr);
+
+	SDL_DestroyCond(p->idle);
+	SDL_DestroyCond(p->wake);
+	SDL_DestroyMutex(p->lock);
+}
+
+// Call job(data, 0..count-1) spread over all workers, returns when all are done
+void RunJobs(job_pool* p, void (*job)(void* data, int index), void* data, int count)
+{
+	SDL_LockMutex(p->lock);
+	p->job = job;
+	p->data = data;
+	p->count = count;
+	p->busy = p->num_threads;
+	SDL_AtomicSet(&p->next, 0);
+	++p->batch;
+	SDL_CondBroadcast(p->wake);
+	SDL_UnlockMutex(p->lock);
+
+	RunPendingJobs(p);
+
+	SDL_LockMutex(p->lock);
+	while (p->busy > 0)
+		SDL_CondWait(p->idle, p->lock);
+	SDL_UnlockMutex(p->lock);
+}
+
+// ----------------------------------------------------------------
+thread_local profile_ring* thread_ring = nullptr;
+
+void ProfileRecord(const char* name, Uint64 start, Uint64 end, int value)
+{
+	profile_ring* ring = thread_ring;
+	if (ring == nullptr)
+	{
+		int index = SDL_AtomicAdd(&g.profiler.num_rings, 1);
+		if (index >= PROFILER_THREADS)
+			return;
+
+		ring = thread_ring = (profile_ring*)SDL_calloc(1, sizeof(profile_ring));
+		ring->thread = index;
+		g.profiler.rings[index] = ring;
+	}
+
+	int count = SDL_AtomicGet(&ring->count);
+	profile_event* e = &ring->events[count % PROFILER_EVENTS];
+	e->name = name;
+	e->start = start;
+	e->end = end;
+	e->value = value;
+	SDL_AtomicSet(&ring->count, count + 1);
+}
+
+struct profile_zone
+{
+	const char* name;
+	Uint64 start;
+
+	profile_zone(const char* zone_name) : name(zone_name), start(g.profiler.enabled ? SDL_GetPerformanceCounter() : 0) {}
+	~profile_zone()
+	{
+		if (start != 0)
+			ProfileRecord(name, start, SDL_GetPerformanceCounter(), 0);
+	}
+};
+
+// Shows as a graph in the trace
+void ProfileCounter(const char* name, int value)
+{
+	if (g.profiler.enabled)
+		ProfileRecord(name, SDL_GetPerformanceCounter(), 0, value);
+}
+
+// Write all recorded zones as Chrome trace events (about:tracing or Perfetto)
+void SaveProfile()
+{
+	if (g.profiler.enabled == false)
+		return;
+
+	SDL_RWops* rw = SDL_RWFromFile(g.profiler.file, "wb");
+	if (rw == nullptr)
+	{
+		SDL_Log("Could not save profile %s", g.profiler.file);
+		return;
+	}
+
+	double to_us = 1000000.0 / double(SDL_GetPerformanceFrequency());
+	const char* separator = "";
+	char line[256];
+
+	SDL_RWwrite(rw, "{\"traceEvents\":[\n", 1, 17);
+	int num_rings = SDL_AtomicGet(&g.profiler.num_rings);
+	CAP(num_rings, 0, PROFILER_THREADS);
+
+	// Same moment for all threads, events written after this are left for next time --
+	int counts[PROFILER_THREADS];
+	for (int r = 0; r < num_rings; ++r)
+		counts[r] = (g.profiler.rings[r] != nullptr) ? SDL_AtomicGet(&g.profiler.rings[r]->count) : 0;
+
+	for (int r = 0; r < num_rings; ++r)
+	{
+		profile_ring* ring = g.profiler.rings[r];
+		if (ring == nullptr)
+			continue;
+
+		int count = counts[r];
+		int first = (count > PROFILER_EVENTS) ? count - PROFILER_EVENTS : 0;
+		for (int i = first; i < count; ++i)
+		{
+			// other threads keep recording while we save (F12), an event copied after its slot
+			// started to be written again may be torn and is dropped
+			profile_event copy = ring->events[i % PROFILER_EVENTS];
+			if (SDL_AtomicGet(&ring->count) - i >= PROFILER_EVENTS)
+				continue;
+
+			const profile_event* e = &copy;
+			int len;
+			if (e->end == 0)
+				len = SDL_snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%d}}",
+					separator, e->name, ring->thread, double(e->start - g.profiler.start) * to_us, e->value);
+			else
+				len = SDL_snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					separator, e->name, ring->thread, double(e->start - g.profiler.start) * to_us, double(e->end - e->start) * to_us);
+			SDL_RWwrite(rw, line, 1, len);
+			separator = ",\n";
+		}
+	}
+	SDL_RWwrite(rw, "\n]}\n", 1, 4);
+	SDL_RWclose(rw);
+
+	SDL_Log("Profile saved to %s", g.profiler.file);
+}
+
+// ----------------------------------------------------------------
+bool IsAlive(const Uint32* alive, int i)
+{
+	return ((alive[i >> 5] >> (i & 31)) & 1u) != 0;
+}
+
+template <int N>
+void InitPool(slot_pool<N>* p)
+{
+	static_assert(N <= MAX_POOL_SIZE, "too many slots for a pool");
+	SDL_memset(p, 0, sizeof(*p));
+	p->num_free = N;
+	for (int i = 0; i < N; ++i)
+		p->free[i] = Uint16(N - 1 - i); // so slot 0 goes first
+}
+
+// Returns a free slot or -1 when all of them are alive
+template <int N>
+int Acquire(slot_pool<N>* p)
+{
+	if (p->num_free == 0)
+		return -1;
+
+	int slot = p->free[--p->num_free];
+	p->where[slot] = Uint16(p->num_live);
+	p->live[p->num_live++] = Uint16(slot);
+	p->alive[slot >> 5] |= 1u << (slot & 31);
+	return slot;
+}
+
+// Last live slot takes the place of the released one in the live list
+template <int N>
+void Release(slot_pool<N>* p, int slot)
+{
+	int pos = p->where[slot];
+	int last = p->live[--p->num_live];
+	p->live[pos] = Uint16(last);
+	p->where[last] = Uint16(pos);
+	p->free[p->num_free++] = Uint16(slot);
+	p->alive[slot >> 5] &= ~(1u << (slot & 31));
+}
+
+template <int N>
+void ReleaseLanes(slot_pool<N>* p, int first, unsigned lanes)
+{
+	for (int k = 0; lanes != 0; ++k, lanes >>= 1)
+		if (lanes & 1u)
+			Release(p, first + k);
+}
+
+// ----------------------------------------------------------------
+void InitTimers(timer_wheel* t)
+{
+	SDL_memset(t->head, 0xff, sizeof(t->head));
+	SDL_memset(t->tail, 0xff, sizeof(t->tail));
+	InitPool(&t->pool);
+}
+
+// Level is picked by how far the timer is, slot by the bits of its due tick for that level
+void LinkTimer(timer_wheel* t, int id, unsigned now)
+{
+	unsigned delta = int(t->due[id] - now) > 0 ? t->due[id] - now : 0u;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= 1u << (TIMER_BITS * (level + 1)))
+		++level;
+	if (delta >= 1u << (TIMER_BITS * TIMER_LEVELS))
+		delta = (1u << (TIMER_BITS * TIMER_LEVELS)) - 1; // comes back here when cascaded
+
+	int list = level * TIMER_SLOTS + int(((now + delta) >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1));
+	t->list[id] = Sint16(list);
+	t->next[id] = -1;
+	t->prev[id] = t->tail[list];
+	if (t->tail[list] >= 0)
+		t->next[t->tail[list]] = Sint16(id);
+	else
+		t->head[list] = Sint16(id);
+	t->tail[list] = Sint16(id);
+}
+
+void UnlinkTimer(timer_wheel* t, int id)
+{
+	int list = t->list[id];
+	if (t->prev[id] >= 0)
+		t->next[t->prev[id]] = t->next[id];
+	else
+		t->head[list] = t->next[id];
+	if (t->next[id] >= 0)
+		t->prev[t->next[id]] = t->prev[id];
+	else
+		t->tail[list] = t->prev[id];
+}
+
+// Calls back at the end of tick "due" (the current one at the earliest), returns -1 when out of timers
+int ScheduleTimer(world* w, unsigned due, timer_callback callback, int data)
+{
+	timer_wheel* t = &w->timers;
+	int id = Acquire(&t->pool);
+	if (id >= 0)
+	{
+		t->due[id] = due;
+		t->callback[id] = callback;
+		t->data[id] = data;
+		LinkTimer(t, id, w->tick);
+	}
+	return id;
+}
+
+void CancelTimer(timer_wheel* t, int id)
+{
+	UnlinkTimer(t, id);
+	Release(&t->pool, id);
+}
+
+// Timers of a coarser level slot go down a level (or more) when its first tick comes
+void CascadeTimers(timer_wheel* t, int list, unsigned now)
+{
+	int id = t->head[list];
+	t->head[list] = t->tail[list] = -1;
+	while (id >= 0)
+	{
+		int next = t->next[id];
+		LinkTimer(t, id, now);
+		id = next;
+	}
+}
+
+// Fires what is due this tick, callbacks may schedule more timers for this same tick
+void RunTimers(world* w)
+{
+	PROFILE("timers");
+
+	timer_wheel* t = &w->timers;
+	unsigned now = w->tick;
+	for (int level = TIMER_LEVELS - 1; level > 0; --level)
+	{
+		unsigned shift = TIMER_BITS * level;
+		if ((now & ((1u << shift) - 1)) == 0)
+			CascadeTimers(t, level * TIMER_SLOTS + int((now >> shift) & (TIMER_SLOTS - 1)), now);
+	}
+
+	int list = int(now & (TIMER_SLOTS - 1));
+	while (t->head[list] >= 0)
+	{
+		int id = t->head[list];
+		timer_callback callback = t->callback[id];
+		int data = t->data[id];
+		CancelTimer(t, id);
+		callback(w, data);
+	}
+}
+
+// ----------------------------------------------------------------
+void OnWaveTimer(world* w, int)
+{
+	w->spawning = true;
+}
+
+void OnFireTimer(world* w, int)
+{
+	w->can_fire = true;
+}
+
+void OnExplosionTimer(world* w, int slot)
+{
+	Release(&w->explosions.pool, slot);
+}
+
+// Player gets the ship the tick after it can be hit again
+void OnControlTimer(world* w, int)
+{
+	w->controls = true;
+	w->ship_timer = -1;
+}
+
+void OnInvulnerableTimer(world* w, int)
+{
+	w->invulnerable = false;
+	w->ship_timer = ScheduleTimer(w, w->tick + 1, OnControlTimer, 0);
+}
+
+// Invulnerability lasts INTRO_FREE_TIMER after the first INTRO_FREE_TIMER of the intro,
+// but never ends before the ship is done flying in --
+void OnIntroTimer(world* w, int start)
+{
+	unsigned end = unsigned(start) + 2 * MS_TO_TICKS(INTRO_FREE_TIMER);
+	w->intro = false;
+	w->ship_timer = ScheduleTimer(w, end > w->tick ? end : w->tick, OnInvulnerableTimer, 0);
+}
+
+// Ship flies in from the left, can't be hit or moved until its timers are done
+void StartIntro(world* w)
+{
+	w->intro = w->invulnerable = true;
+	w->controls = false;
+	if (w->ship_timer >= 0)
+		CancelTimer(&w->timers, w->ship_timer);
+	w->ship_timer = ScheduleTimer(w, w->tick + MS_TO_TICKS(INTRO_TIMER) + 1, OnIntroTimer, int(w->tick));
+}
+
+void InitWorld(world* w)
+{
+	SDL_memset(w, 0, sizeof(*w));
+	w->ship_x = -SPRITE_SIZE * 3;
+	w->ship_y = SCREEN_HEIGHT / 2;
+	w->spawn_height = 100;
+	InitPool(&w->shots.pool);
+	InitPool(&w->enemies.pool);
+	InitPool(&w->explosions.pool);
+	InitTimers(&w->timers);
+	w->tick = 1;
+	w->ship_timer = -1;
+	StartIntro(w);
+	ScheduleTimer(w, w->tick + MS_TO_TICKS(SHOT_TIMER), OnFireTimer, 0);
+	ScheduleTimer(w, w->tick + MS_TO_TICKS(WAVE_TIMER), OnWaveTimer, 0);
+}
+
+// ----------------------------------------------------------------
+void ClosePack(asset_pack* pack)
+{
+#ifdef _WIN32
+	if (pack->data != nullptr)
+		UnmapViewOfFile(pack->data);
+	if (pack->mapping != nullptr)
+		CloseHandle(pack->mapping);
+	if (pack->file != nullptr && pack->file != INVALID_HANDLE_VALUE)
+		CloseHandle(pack->file);
+#else
+	if (pack->data != nullptr)
+		munmap((void*)pack->data, pack->size);
+#endif
+	SDL_memset(pack, 0, sizeof(*pack));
+}
+
+// Map the whole archive read only, the pixels are uploaded straight from the mapping --
+bool OpenPack(asset_pack* pack, const char* file)
+{
+	PROFILE("open pack");
+	SDL_memset(pack, 0, sizeof(*pack));
+
+#ifdef _WIN32
+	pack->file = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size;
+	if (pack->file == INVALID_HANDLE_VALUE || GetFileSizeEx(pack->file, &size) == FALSE || size.QuadPart == 0)
+	{
+		ClosePack(pack);
+		return false;
+	}
+	pack->size = size_t(size.QuadPart);
+	pack->mapping = CreateFileMappingA(pack->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (pack->mapping != nullptr)
+		pack->data = (const Uint8*)MapViewOfFile(pack->mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	int fd = open(file, O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	pack->size = size_t(info.st_size);
+	void* data = mmap(nullptr, pack->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data != MAP_FAILED)
+		pack->data = (const Uint8*)data;
+#endif
+
+	if (pack->data == nullptr)
+	{
+		ClosePack(pack);
+		return false;
+	}
+
+	// Check the index before trusting any offset in it --
+	const pack_header* header = (const pack_header*)pack->data;
+	bool ret = pack->size >= sizeof(pack_header) && SDL_memcmp(header->magic, PACK_MAGIC, 4) == 0 &&
+		header->version == PACK_VERSION && header->format == PACK_FORMAT &&
+		header->num_entries <= (pack->size - sizeof(pack_header)) / sizeof(pack_entry);
+
+	pack->entries = (const pack_entry*)(pack->data + sizeof(pack_header));
+	pack->num_entries = ret ? int(header->num_entries) : 0;
+	for (int i = 0; i < pack->num_entries && ret; ++i)
+	{
+		const pack_entry* e = &pack->entries[i];
+		ret = e->name[PACK_NAME_SIZE - 1] == '\0' && e->pitch >= e->width * 4 && e->offset <= pack->size &&
+			Uint64(e->pitch) * e->height <= pack->size - e->offset;
+	}
+
+	if (ret == false)
+	{
+		SDL_Log("Ignoring %s, it is broken or from another version", file);
+		ClosePack(pack);
+	}
+	return ret;
+}
+
+// Size and last write time of a file, false when it can't be found
+bool GetFileStamp(const char* file, Uint64* size, Uint64* time)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (GetFileAttributesExA(file, GetFileExInfoStandard, &info) == FALSE)
+		return false;
+	*size = (Uint64(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+	*time = (Uint64(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat info;
+	if (stat(file, &info) != 0)
+		return false;
+	*size = Uint64(info.st_size);
+	*time = Uint64(info.st_mtime);
+#endif
+	return true;
+}
+
+// Entries whose png changed after packing are skipped, the png gets decoded instead --
+const pack_entry* FindInPack(const asset_pack* pack, const char* name)
+{
+	for (int i = 0; i < pack->num_entries; ++i)
+	{
+		const pack_entry* e = &pack->entries[i];
+		if (SDL_strcmp(e->name, name) != 0)
+			continue;
+
+		Uint64 size, time;
+		if (GetFileStamp(name, &size, &time) && (size != e->source_size || time != e->source_time))
+		{
+			SDL_Log("%s changed since it was packed, loading the png", name);
+			return nullptr;
+		}
+		return e;
+	}
+	return nullptr;
+}
+
+// Decode every png once and save it with the pixel format the renderer wants --
+bool SavePack(const char* file)
+{
+	const char* files[NUM_LAYERS + 1];
+	for (int i = 0; i < NUM_LAYERS; ++i)
+		files[i] = tex_layers[i];
+	files[NUM_LAYERS] = tex_atlas;
+	const int num_files = SDL_arraysize(files);
+
+	// Written aside and moved over the archive when complete, a failed bake leaves the old one as it was --
+	char temp[256];
+	SDL_snprintf(temp, sizeof(temp), "%s.tmp", file);
+	SDL_RWops* rw = SDL_RWFromFile(temp, "wb");
+	if (rw == nullptr)
+		return false;
+
+	pack_header header = {};
+	SDL_memcpy(header.magic, PACK_MAGIC, 4);
+	header.version = PACK_VERSION;
+	header.format = PACK_FORMAT;
+	header.num_entries = num_files;
+
+	pack_entry entries[num_files];
+	SDL_memset(entries, 0, sizeof(entries));
+	SDL_Surface* surfaces[num_files];
+	Uint32 offset = sizeof(header) + sizeof(entries);
+	bool ret = true;
+
+	for (int i = 0; i < num_files; ++i)
+	{
+		pack_entry* e = &entries[i];
+		SDL_Surface* loaded = IMG_Load(files[i]);
+		surfaces[i] = loaded ? SDL_ConvertSurfaceFormat(loaded, PACK_FORMAT, 0) : nullptr;
+		SDL_FreeSurface(loaded);
+		if (surfaces[i] == nullptr || SDL_strlen(files[i]) >= PACK_NAME_SIZE || GetFileStamp(files[i], &e->source_size, &e->source_time) == false)
+		{
+			SDL_Log("Could not pack %s", files[i]);
+			ret = false;
+			continue;
+		}
+
+		SDL_strlcpy(e->name, files[i], PACK_NAME_SIZE);
+		e->width = surfaces[i]->w;
+		e->height = surfaces[i]->h;
+		e->pitch = surfaces[i]->w * 4; // rows are written tight, whatever the surface pitch was
+		e->offset = (offset + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+		offset = e->offset + e->pitch * e->height;
+	}
+
+	if (ret)
+	{
+		ret = SDL_RWwrite(rw, &header, sizeof(header), 1) == 1 && SDL_RWwrite(rw, entries, sizeof(entries), 1) == 1;
+		for (int i = 0; i < num_files && ret; ++i)
+		{
+			static const Uint8 zeros[PACK_ALIGN] = {};
+			size_t padding = size_t(entries[i].offset - SDL_RWtell(rw));
+			ret = padding == 0 || SDL_RWwrite(rw, zeros, padding, 1) == 1;
+
+			SDL_LockSurface(surfaces[i]);
+			for (Uint32 y = 0; y < entries[i].height && ret; ++y)
+				ret = SDL_RWwrite(rw, (Uint8*)surfaces[i]->pixels + y * surfaces[i]->pitch, entries[i].pitch, 1) == 1;
+			SDL_UnlockSurface(surfaces[i]);
+		}
+		SDL_Log("Packed %d textures in %s, %u bytes", num_files, file, offset);
+	}
+
+	for (int i = 0; i < num_files; ++i)
+		SDL_FreeSurface(surfaces[i]);
+
+	ret = SDL_RWclose(rw) == 0 && ret;
+#ifdef _WIN32
+	ret = ret && MoveFileExA(temp, file, MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+	ret = ret && rename(temp, file) == 0;
+#endif
+	if (ret == false)
+	{
+		remove(temp);
+		SDL_Log("Could not bake %s, it was left untouched", file);
+	}
+	return ret;
+}
+
+// ----------------------------------------------------------------
+// Reference an asset, it is loaded on the next call to LoadAssets() --
+asset_handle AcquireAsset(asset_manager* m, asset_kind kind, const char* file)
+{
+	int slot = -1;
+	for (int i = 0; i < MAX_ASSETS; ++i)
+	{
+		asset* a = &m->slots[i];
+		if (a->file != nullptr && a->kind == kind && SDL_strcmp(a->file, file) == 0)
+		{
+			slot = i;
+			break;
+		}
+		if (a->file == nullptr && slot < 0)
+			slot = i;
+	}
+
+	if (slot < 0)
+	{
+		SDL_Log("Too many assets, could not add %s", file);
+		return 0;
+	}
+
+	asset* a = &m->slots[slot];
+	if (a->file == nullptr)
+	{
+		Uint16 generation = a->generation + 1;
+		SDL_memset(a, 0, sizeof(*a));
+		a->kind = kind;
+		a->file = file;
+		a->generation = (generation == 0) ? 1 : generation;
+	}
+	++a->refs;
+	return (asset_handle(a->generation) << 16) | asset_handle(slot);
+}
+
+asset* GetAsset(asset_manager* m, asset_handle handle)
+{
+	asset* a = &m->slots[ASSET_INDEX(handle) % MAX_ASSETS];
+	return (handle != 0 && a->file != nullptr && a->generation == ASSET_GENERATION(handle)) ? a : nullptr;
+}
+
+SDL_Texture* GetTexture(asset_handle handle)
+{
+	asset* a = GetAsset(&g.assets, handle);
+	return a ? a->texture : nullptr;
+}
+
+Mix_Music* GetMusic(asset_handle handle)
+{
+	asset* a = GetAsset(&g.assets, handle);
+	return a ? a->music : nullptr;
+}
+
+const soft_image* GetImage(asset_handle handle)
+{
+	asset* a = GetAsset(&g.assets, handle);
+	return (a && a->image.pixels) ? &a->image : nullptr;
+}
+
+Mix_Chunk* GetChunk(asset_handle handle)
+{
+	asset* a = GetAsset(&g.assets, handle);
+	return a ? a->chunk : nullptr;
+}
+
+// Drop a reference, the last one frees the asset --
+void ReleaseAsset(asset_manager* m, asset_handle handle)
+{
+	asset* a = GetAsset(m, handle);
+	if (a == nullptr || --a->refs > 0)
+		return;
+
+	SDL_FreeSurface(a->surface);
+	SDL_free(a->image.pixels);
+	if (a->texture != nullptr)
+		SDL_DestroyTexture(a->texture);
+	if (a->music != nullptr)
+		Mix_FreeMusic(a->music);
+	if (a->chunk != nullptr)
+		Mix_FreeChunk(a->chunk);
+
+	Uint16 generation = a->generation;
+	SDL_memset(a, 0, sizeof(*a));
+	a->generation = generation;
+}
+
+Uint32 Mul255(Uint32 c, Uint32 a)
+{
+	Uint32 x = c * a + 128; // exact c*a/255 rounded, for c and a in 0..255
+	return (x + (x >> 8)) >> 8;
+}
+
+// Copy ARGB8888 pixels with color multiplied by alpha
+bool MakeImage(soft_image* image, const Uint8* pixels, int width, int height, int pitch)
+{
+	image->pixels = (Uint32*)SDL_malloc(size_t(width) * height * 4);
+	if (image->pixels == nullptr)
+		return false;
+
+	image->width = width;
+	image->height = height;
+	image->opaque = true;
+	for (int y = 0; y < height; ++y)
+	{
+		const Uint32* in = (const Uint32*)(pixels + y * pitch);
+		Uint32* out = image->pixels + y * width;
+		for (int x = 0; x < width; ++x)
+		{
+			Uint32 p = in[x];
+			Uint32 a = p >> 24;
+			if (a != 255)
+			{
+				image->opaque = false;
+				p = (a << 24) | (Mul255((p >> 16) & 255, a) << 16) | (Mul255((p >> 8) & 255, a) << 8) | Mul255(p & 255, a);
+			}
+			out[x] = p;
+		}
+	}
+	return true;
+}
+
+void DecodeAssetJob(void* data, int index)
+{
+	load_batch* batch = (load_batch*)data;
+	asset* a = batch->pending[index];
+	if (a->packed != nullptr && g.software == false)
+		return; // uploaded straight from the mapping
+
+	PROFILE(a->file);
+
+	switch (a->kind)
+	{
+		case ASSET_IMAGE:
+			if (a->packed != nullptr)
+				MakeImage(&a->image, batch->pack->data + a->packed->offset, a->packed->width, a->packed->height, a->packed->pitch);
+			else
+				a->surface = IMG_Load(a->file);
+			break;
+		case ASSET_MUSIC: a->music = Mix_LoadMUS(a->file); break;
+		case ASSET_WAV: a->chunk = Mix_LoadWAV(a->file); break;
+	}
+
+	// The software renderer keeps its own premultiplied copy, not the surface --
+	if (g.software && a->surface != nullptr)
+	{
+		a->decode_bytes = size_t(a->surface->pitch) * a->surface->h;
+		SDL_Surface* argb = SDL_ConvertSurfaceFormat(a->surface, SDL_PIXELFORMAT_ARGB8888, 0);
+		if (argb != nullptr)
+		{
+			MakeImage(&a->image, (const Uint8*)argb->pixels, argb->w, argb->h, argb->pitch);
+			SDL_FreeSurface(argb);
+		}
+		SDL_FreeSurface(a->surface);
+		a->surface = nullptr;
+	}
+
+	if (a->surface == nullptr && a->image.pixels == nullptr && a->music == nullptr && a->chunk == nullptr)
+		SDL_Log("Could not load %s", a->file);
+}
+
+void UploadTexture(const asset_pack* pack, asset* a)
+{
+	if (g.software)
+	{
+		a->width = a->image.width;
+		a->height = a->image.height;
+		a->cpu_bytes = size_t(a->width) * a->height * 4;
+		return;
+	}
+
+	if (a->packed != nullptr)
+	{
+		const pack_entry* e = a->packed;
+		a->texture = SDL_CreateTexture(g.renderer, PACK_FORMAT, SDL_TEXTUREACCESS_STATIC, e->width, e->height);
+		SDL_UpdateTexture(a->texture, nullptr, pack->data + e->offset, e->pitch);
+		SDL_SetTextureBlendMode(a->texture, SDL_BLENDMODE_BLEND);
+	}
+	else if (a->surface != nullptr)
+	{
+		a->decode_bytes = size_t(a->surface->pitch) * a->surface->h;
+		a->texture = SDL_CreateTextureFromSurface(g.renderer, a->surface);
+		SDL_FreeSurface(a->surface);
+		a->surface = nullptr;
+	}
+
+	Uint32 format;
+	if (a->texture != nullptr && SDL_QueryTexture(a->texture, &format, nullptr, &a->width, &a->height) == 0)
+		a->gpu_bytes = size_t(a->width) * a->height * SDL_BYTESPERPIXEL(format);
+}
+
+// Decode all pending files on the job pool, only uploads to the renderer stay on this thread --
+void LoadAssets(asset_manager* m)
+{
+	load_batch batch;
+	asset** pending = batch.pending;
+	int num_pending = 0;
+	for (int i = 0; i < MAX_ASSETS; ++i)
+	{
+		if (m->slots[i].file != nullptr && m->slots[i].loaded == false)
+			pending[num_pending++] = &m->slots[i];
+	}
+
+	Uint64 begin = SDL_GetPerformanceCounter();
+
+	// Textures found in the archive skip png decoding --
+	asset_pack pack;
+	if (OpenPack(&pack, PACK_FILE))
+	{
+		for (int i = 0; i < num_pending; ++i)
+			pending[i]->packed = (pending[i]->kind == ASSET_IMAGE) ? FindInPack(&pack, pending[i]->file) : nullptr;
+	}
+	batch.pack = &pack;
+
+	{
+		PROFILE("decode assets");
+		RunJobs(&g.pool, DecodeAssetJob, &batch, num_pending);
+	}
+	Uint64 decoded = SDL_GetPerformanceCounter();
+
+	{
+		PROFILE("upload textures");
+		for (int i = 0; i < num_pending; ++i)
+		{
+			asset* a = pending[i];
+			if (a->kind == ASSET_IMAGE)
+				UploadTexture(&pack, a);
+			else if (a->chunk != nullptr)
+				a->cpu_bytes = a->chunk->alen;
+			a->packed = nullptr;
+			a->loaded = true;
+		}
+	}
+	ClosePack(&pack);
+
+	double to_ms = 1000.0 / double(SDL_GetPerformanceFrequency());
+	SDL_Log("%d assets decoded in %.1f ms on %d threads, uploaded in %.1f ms", num_pending,
+		double(decoded - begin) * to_ms, g.pool.num_threads + 1, double(SDL_GetPerformanceCounter() - decoded) * to_ms);
+}
+
+// Music is streamed from its file so only sound effects count as cpu memory --
+void LogAssetMemory(const asset_manager* m)
+{
+	size_t cpu = 0, gpu = 0, decode = 0;
+	for (int i = 0; i < MAX_ASSETS; ++i)
+	{
+		const asset* a = &m->slots[i];
+		if (a->file == nullptr)
+			continue;
+
+		SDL_Log("  %-24s refs %d  cpu %7u KB  gpu %7u KB  decoded %7u KB (freed)", a->file, a->refs,
+			unsigned(a->cpu_bytes / 1024), unsigned(a->gpu_bytes / 1024), unsigned(a->decode_bytes / 1024));
+		cpu += a->cpu_bytes;
+		gpu += a->gpu_bytes;
+		decode += a->decode_bytes;
+	}
+	SDL_Log("Assets total: cpu %u KB, gpu %u KB, %u KB of decoded images freed after upload",
+		unsigned(cpu / 1024), unsigned(gpu / 1024), unsigned(decode / 1024));
+}
+
+// ----------------------------------------------------------------
+// Game side, never waits: when the ring is full the sound is dropped
+void PushAudio(audio_mixer* m, const Mix_Chunk* chunk, int volume)
+{
+	int written = SDL_AtomicGet(&m->written);
+	if (written - SDL_AtomicGet(&m->read) == AUDIO_COMMANDS)
+	{
+		++m->dropped;
+		return;
+	}
+
+	audio_command* c = &m->commands[written & (AUDIO_COMMANDS - 1)];
+	c->chunk = chunk;
+	c->volume = volume;
+	SDL_AtomicSet(&m->written, written + 1); // publish after the write
+}
+
+// Like Mix_PlayChannel(-1, ...), nothing plays when all voices are busy
+void StartVoice(audio_mixer* m, const audio_command* c)
+{
+	for (int i = 0; i < MAX_VOICES; ++i)
+	{
+		audio_voice* v = &m->voices[i];
+		if (v->samples == nullptr)
+		{
+			v->samples = (const Sint16*)c->chunk->abuf;
+			v->left = int(c->chunk->alen / 2);
+			v->volume = c->volume;
+			return;
+		}
+	}
+}
+
+// out += samples * volume, saturated to 16 bits
+void MixVoice(Sint16* out, const Sint16* samples, int count, int volume)
+{
+	int i = 0;
+#ifdef USE_SSE2
+	if (volume == MIX_MAX_VOLUME)
+	{
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i mixed = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)&out[i]), _mm_loadu_si128((const __m128i*)&samples[i]));
+			_mm_storeu_si128((__m128i*)&out[i], mixed);
+		}
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		int mixed = out[i] + samples[i] * volume / MIX_MAX_VOLUME;
+		CAP(mixed, -32768, 32767);
+		out[i] = Sint16(mixed);
+	}
+}
+
+// Post mix hook, runs in the audio thread on top of what SDL_mixer mixed (music) --
+void MixAudio(void* data, Uint8* stream, int len)
+{
+	audio_mixer* m = (audio_mixer*)data;
+
+	// A callback coming later than half a buffer past due most likely left the device with nothing
+	// to play. It's a guess from timing, SDL doesn't tell us about real underruns --
+	Uint64 now = SDL_GetPerformanceCounter();
+	if (m->callbacks++ > 0)
+	{
+		Uint64 gap = now - m->last_mix;
+		Uint64 period = SDL_GetPerformanceFrequency() * Uint64(len / m->frame_bytes) / m->frequency;
+		if (gap > period + period / 2)
+			++m->underruns;
+		if (gap > m->longest)
+			m->longest = gap;
+	}
+	m->last_mix = now;
+
+	int read = SDL_AtomicGet(&m->read);
+	int written = SDL_AtomicGet(&m->written);
+	for (; read != written; ++read)
+		StartVoice(m, &m->commands[read & (AUDIO_COMMANDS - 1)]);
+	SDL_AtomicSet(&m->read, read); // slots can be written again
+
+	int count = len / 2;
+	for (int i = 0; i < MAX_VOICES; ++i)
+	{
+		audio_voice* v = &m->voices[i];
+		if (v->samples == nullptr)
+			continue;
+
+		int n = SDL_min(count, v->left);
+		MixVoice((Sint16*)stream, v->samples, n, v->volume);
+		v->samples += n;
+		v->left -= n;
+		if (v->left == 0)
+			v->samples = nullptr;
+	}
+}
+
+// Capture thread: first loud sample after a laser was fired is when we heard it
+void CaptureAudio(void* data, Uint8* stream, int len)
+{
+	latency_test* t = (latency_test*)data;
+	Uint64 now = SDL_GetPerformanceCounter();
+	if (t->pressed == 0)
+		return;
+
+	const Sint16* samples = (const Sint16*)stream;
+	int count = len / 2;
+	for (int i = 0; i < count; ++i)
+	{
+		if (SDL_abs(samples[i]) >= LATENCY_THRESHOLD)
+		{
+			// sample i was recorded count - i samples before the buffer got to us
+			Uint64 heard = now - SDL_GetPerformanceFrequency() * (count - i) / t->frequency;
+			if (heard > t->pressed && t->heard < LATENCY_SHOTS)
+				t->ms[t->heard++] = double(heard - t->pressed) * 1000.0 / double(SDL_GetPerformanceFrequency());
+			t->pressed = 0;
+			return;
+		}
+	}
+}
+
+void StartLatencyTest(latency_test* t, int samples)
+{
+	SDL_AudioSpec want, have;
+	SDL_zero(want);
+	want.freq = AUDIO_FREQUENCY;
+	want.format = AUDIO_S16SYS;
+	want.channels = 1;
+	want.samples = Uint16(samples);
+	want.callback = CaptureAudio;
+	want.userdata = t;
+	t->capture = SDL_OpenAudioDevice(nullptr, 1, &want, &have, 0); // SDL converts to what we want
+	if (t->capture == 0)
+	{
+		SDL_Log("Latency test: no capture device (%s)", SDL_GetError());
+		t->enabled = false;
+		return;
+	}
+
+	t->frequency = have.freq;
+	t->next_press = SDL_GetPerformanceCounter() + SDL_GetPerformanceFrequency() * LATENCY_START / 1000u;
+	SDL_PauseAudioDevice(t->capture, 0);
+}
+
+// Simulation thread: the laser of the last press is about to be queued, from now on the microphone
+// listens for it. Still timed from the press --
+void ListenForLaser(latency_test* t)
+{
+	if (t->press == 0)
+		return; // a shot of the player, not of the test
+
+	SDL_LockAudioDevice(t->capture);
+	t->pressed = t->press;
+	SDL_UnlockAudioDevice(t->capture);
+	t->press = 0;
+	++t->fired;
+}
+
+void LogLatencyTest(const latency_test* t)
+{
+	if (t->heard == 0)
+	{
+		SDL_Log("Latency test: nothing heard, %d of %d presses fired a laser, are the speakers on?", t->fired, t->presses);
+		return;
+	}
+
+	double min = t->ms[0], max = t->ms[0], total = 0.0;
+	for (int i = 0; i < t->heard; ++i)
+	{
+		min = SDL_min(min, t->ms[i]);
+		max = SDL_max(max, t->ms[i]);
+		total += t->ms[i];
+	}
+	SDL_Log("Latency test: fire to sound %.1f ms average, %.1f min, %.1f max, %d of %d presses heard (%d fired a laser)",
+		total / t->heard, min, max, t->heard, t->presses, t->fired);
+}
+
+// ----------------------------------------------------------------
+void Start(bool headless)
+{
+	SDL_Init(headless ? SDL_INIT_TIMER : SDL_INIT_EVERYTHING);
+	g.headless = headless; // g is a global, everything else starts as 0/null
+	StartPool(&g.pool);
+	InitWorld(&g.game);
+
+	// No window, renderer, images or audio when running headless --
+	if (headless)
+		return;
+
+	// Create window & renderer
+	g.window = SDL_CreateWindow("QSS - 0.7", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+	g.renderer = SDL_CreateRenderer(g.window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+
+	// Without a gpu SDL falls back to its generic software renderer, our own blitter is faster --
+	SDL_RendererInfo info;
+	if (SDL_GetRendererInfo(g.renderer, &info) == 0 && (info.flags & SDL_RENDERER_SOFTWARE) != 0)
+		g.software = true;
+	if (g.software)
+	{
+		g.soft.pixels = (Uint32*)SDL_malloc(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+		g.soft.screen = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+		g.software = g.soft.pixels != nullptr && g.soft.screen != nullptr;
+		SDL_Log("Software renderer %s", g.software ? "on" : "could not start");
+	}
+
+	// Load image lib and create mixer, Mix_LoadWAV converts to the format of the opened device --
+	IMG_Init(IMG_INIT_PNG);
+	Mix_Init(MIX_INIT_OGG);
+	if (g.audio.samples == 0)
+		g.audio.samples = AUDIO_BUFFER;
+	Mix_OpenAudio(AUDIO_FREQUENCY, MIX_DEFAULT_FORMAT, 2, g.audio.samples);
+
+	// Our hook only mixes 16 bit stereo, that is what we ask for but the device may differ.
+	// It is installed anyway to time the callbacks --
+	int channels;
+	Uint16 format;
+	if (Mix_QuerySpec(&g.audio.frequency, &format, &channels) != 0)
+	{
+		g.audio.hooked = format == AUDIO_S16SYS && channels == 2;
+		g.audio.frame_bytes = SDL_AUDIO_BITSIZE(format) / 8 * channels;
+		Mix_SetPostMix(MixAudio, &g.audio);
+		SDL_Log("Audio: %d Hz, %d samples per mix (%.1f ms)", g.audio.frequency, g.audio.samples, g.audio.samples * 1000.0 / g.audio.frequency);
+	}
+	if (g.latency.enabled)
+		StartLatencyTest(&g.latency, g.audio.samples);
+
+	for (int i = 0; i < NUM_LAYERS; ++i)
+	{
+		g.layers[i].texture = AcquireAsset(&g.assets, ASSET_IMAGE, tex_layers[i]);
+		g.layers[i].speed = layer_speeds[i];
+	}
+	g.atlas = AcquireAsset(&g.assets, ASSET_IMAGE, tex_atlas);
+	g.music = AcquireAsset(&g.assets, ASSET_MUSIC, ASSETS_DIR "music.ogg");
+	g.fx_shoot = AcquireAsset(&g.assets, ASSET_WAV, ASSETS_DIR "laser.wav");
+	g.fx_explosion = AcquireAsset(&g.assets, ASSET_WAV, ASSETS_DIR "explosion.wav");
+	LoadAssets(&g.assets);
+	LogAssetMemory(&g.assets);
+
+	for (int i = 0; i < NUM_LAYERS; ++i)
+	{
+		asset* a = GetAsset(&g.assets, g.layers[i].texture);
+		g.layers[i].width = a->width;
+		g.layers[i].height = a->height;
+	}
+	g.font.w = atlas_regions[SPRITE_FONT].rect.w / 10; // w,h are for every single letter, this font should have "0123456789"
+	g.font.h = atlas_regions[SPRITE_FONT].rect.h;
+	for (int i = 0; i < 10; ++i) // "5" to "9" were packed one pixel to the left of where font.png has them
+		g.font.glyphs['0' + i] = { i * g.font.w - (i >= 5 ? 1 : 0), 0, g.font.w, g.font.h };
+
+	// Cached HUD, without render target support it is drawn every frame --
+	g.hud.target = { SCREEN_WIDTH - 20 - g.font.w*8, 10, g.font.w*8 + 10, g.font.h*2 + 10 };
+	if (g.software == false && SDL_RenderTargetSupported(g.renderer))
+		g.hud.texture = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, g.hud.target.w, g.hud.target.h);
+	if (g.hud.texture != nullptr)
+		SDL_SetTextureBlendMode(g.hud.texture, SDL_BLENDMODE_BLEND);
+
+	if (g.latency.enabled == false) // the microphone would hear it
+		Mix_PlayMusic(GetMusic(g.music), -1);
+}
+
+// ----------------------------------------------------------------
+void Finish()
+{
+	StopPool(&g.pool);
+	SDL_free(g.tape.data);
+
+	if (g.headless)
+	{
+		SDL_Quit();
+		return;
+	}
+
+	Mix_HaltMusic();
+	Mix_SetPostMix(nullptr, nullptr); // takes the device lock, no voice is mixed after this
+	if (g.audio.dropped > 0)
+		SDL_Log("Audio: %d sounds dropped with a full command ring", g.audio.dropped);
+	if (g.audio.callbacks > 0)
+		SDL_Log("Audio: %d mixes, %d late enough to be underruns, longest gap %.1f ms", g.audio.callbacks, g.audio.underruns,
+			double(g.audio.longest) * 1000.0 / double(SDL_GetPerformanceFrequency()));
+	if (g.latency.capture != 0)
+	{
+		SDL_CloseAudioDevice(g.latency.capture);
+		LogLatencyTest(&g.latency);
+	}
+	ReleaseAsset(&g.assets, g.music);
+	ReleaseAsset(&g.assets, g.fx_shoot);
+	ReleaseAsset(&g.assets, g.fx_explosion);
+	Mix_CloseAudio();
+	Mix_Quit();
+
+	for(int i = 0; i < NUM_LAYERS; ++i) 
+		ReleaseAsset(&g.assets, g.layers[i].texture);
+	ReleaseAsset(&g.assets, g.atlas);
+	IMG_Quit();
+
+	if (g.hud.texture != nullptr)
+		SDL_DestroyTexture(g.hud.texture);
+	if (g.soft.screen != nullptr)
+		SDL_DestroyTexture(g.soft.screen);
+	SDL_free(g.soft.pixels);
+
+	for (int i = 0; i < MAX_ASSETS; ++i)
+	{
+		if (g.assets.slots[i].file != nullptr)
+			SDL_Log("Asset %s still has %d references", g.assets.slots[i].file, g.assets.slots[i].refs);
+	}
+
+	SDL_DestroyRenderer(g.renderer);
+	SDL_DestroyWindow(g.window);
+	SDL_Quit();
+}
+
+// ----------------------------------------------------------------
+void SetKey(input_state* in, Uint8 bit, bool down)
+{
+	in->held = down ? (in->held | bit) : (in->held & ~bit);
+}
+
+bool CheckInput(input_state* in)
+{
+	PROFILE("CheckInput");
+	bool ret = true;
+	SDL_Event event;
+
+	while(SDL_PollEvent(&event) != 0)
+	{
+		if (event.type == SDL_KEYUP || event.type == SDL_KEYDOWN)
+		{
+			switch(event.key.keysym.sym)
+			{
+				case SDLK_w: SetKey(in, INPUT_UP, event.type == SDL_KEYDOWN); break;
+				case SDLK_s: SetKey(in, INPUT_DOWN, event.type == SDL_KEYDOWN); break;
+				case SDLK_a: SetKey(in, INPUT_LEFT, event.type == SDL_KEYDOWN); break;
+				case SDLK_d: SetKey(in, INPUT_RIGHT, event.type == SDL_KEYDOWN); break;
+				case SDLK_SPACE:
+					SetKey(in, INPUT_FIRE, event.type == SDL_KEYDOWN);
+					in->fire_pressed = (event.type == SDL_KEYDOWN);
+					break;
+				case SDLK_ESCAPE: ret = false; break;
+				case SDLK_F12: if (event.type == SDL_KEYDOWN) SaveProfile(); break;
+			}
+		}
+		else if (event.type == SDL_QUIT)
+			ret = false;
+		else if (event.type == SDL_RENDER_TARGETS_RESET || event.type == SDL_RENDER_DEVICE_RESET)
+			g.hud.valid = false; // render target contents are lost
+	}
+
+	return ret;
+}
+
+// Presses fire like a player would, returns false when all lasers had their time to be heard.
+// Called between WaitSim() and KickSim(), while the simulation thread does not touch the test --
+bool UpdateLatencyTest(latency_test* t, input_state* in, Uint64 now)
+{
+	if (t->release != 0 && now >= t->release)
+	{
+		SetKey(in, INPUT_FIRE, false);
+		t->release = 0;
+		t->press = 0; // no laser came out (ship flying in or laser cooling down), a miss
+	}
+	if (now < t->next_press)
+		return true;
+	if (t->presses == LATENCY_SHOTS)
+		return false;
+
+	SDL_LockAudioDevice(t->capture);
+	t->pressed = 0; // a laser not heard yet counts as missed
+	SDL_UnlockAudioDevice(t->capture);
+	t->press = now;
+	++t->presses;
+
+	SetKey(in, INPUT_FIRE, true);
+	in->fire_pressed = true;
+	t->release = now + SDL_GetPerformanceFrequency() / 20; // well under SHOT_TIMER, one laser per press
+	t->next_press = now + SDL_GetPerformanceFrequency() * LATENCY_INTERVAL / 1000u;
+	return true;
+}
+
+// Sound effects are silently skipped when there is no audio (headless)
+void PlayFx(asset_handle fx)
+{
+	Mix_Chunk* chunk = GetChunk(fx);
+	if (chunk == nullptr)
+		return;
+
+	if (g.audio.hooked)
+		PushAudio(&g.audio, chunk, chunk->volume);
+	else
+		Mix_PlayChannel(-1, chunk, 0);
+}
+
+void PlaySounds(Uint32 sounds)
+{
+	if (sounds & SOUND_SHOOT)
+		PlayFx(g.fx_shoot);
+	if (sounds & SOUND_EXPLOSION)
+		PlayFx(g.fx_explosion);
+}
+
+// ----------------------------------------------------------------
+Uint8 InputMask(const world* w)
+{
+	return (w->up ? INPUT_UP : 0) | (w->down ? INPUT_DOWN : 0) | (w->left ? INPUT_LEFT : 0) |
+		(w->right ? INPUT_RIGHT : 0) | (w->fire ? INPUT_FIRE : 0);
+}
+
+void ApplyInput(world* w, Uint8 mask)
+{
+	w->up = (mask & INPUT_UP) != 0;
+	w->down = (mask & INPUT_DOWN) != 0;
+	w->left = (mask & INPUT_LEFT) != 0;
+	w->right = (mask & INPUT_RIGHT) != 0;
+	w->fire = (mask & INPUT_FIRE) != 0;
+}
+
+// Same as handling the key events right before the batch: fire stays armed until a shot uses it or the key goes up
+void ApplyKeys(world* w, const input_state* in)
+{
+	w->up = (in->held & INPUT_UP) != 0;
+	w->down = (in->held & INPUT_DOWN) != 0;
+	w->left = (in->held & INPUT_LEFT) != 0;
+	w->right = (in->held & INPUT_RIGHT) != 0;
+	if (in->fire_pressed)
+		w->fire = true;
+	else if ((in->held & INPUT_FIRE) == 0)
+		w->fire = false;
+}
+
+void TapeWrite(input_tape* t, Uint8 byte)
+{
+	if (t->size == t->capacity)
+	{
+		t->capacity = (t->capacity == 0) ? 256 : t->capacity * 2;
+		t->data = (Uint8*)SDL_realloc(t->data, t->capacity);
+	}
+	t->data[t->size++] = byte;
+}
+
+void TapeFlushRun(input_tape* t)
+{
+	if (t->run == 0)
+		return;
+
+	TapeWrite(t, t->mask);
+	for (; t->run >= 0x80; t->run >>= 7)
+		TapeWrite(t, Uint8(t->run | 0x80));
+	TapeWrite(t, Uint8(t->run));
+	t->run = 0;
+}
+
+// Call once per tick, input rarely changes so we only store runs
+void RecordInput(input_tape* t, Uint8 mask)
+{
+	if (t->size == 0)
+	{
+		for (int i = 0; i < 4; ++i)
+			TapeWrite(t, TAPE_MAGIC[i]);
+		TapeWrite(t, TAPE_VERSION);
+		TapeWrite(t, SIM_HZ);
+	}
+
+	if (t->run > 0 && mask != t->mask)
+		TapeFlushRun(t);
+
+	t->mask = mask;
+	++t->run;
+}
+
+bool SaveTape(input_tape* t, const char* file)
+{
+	TapeFlushRun(t);
+
+	SDL_RWops* rw = SDL_RWFromFile(file, "wb");
+	if (rw == nullptr)
+		return false;
+
+	bool ret = SDL_RWwrite(rw, t->data, 1, t->size) == size_t(t->size);
+	SDL_RWclose(rw);
+	return ret;
+}
+
+// One run at pos: mask byte and its count of ticks. False for a zero count or a truncated or too long varint
+bool ReadRun(const input_tape* t, int* pos, Uint8* mask, unsigned* count)
+{
+	if (*pos >= t->size)
+		return false;
+
+	*mask = t->data[(*pos)++];
+	*count = 0;
+	for (int shift = 0; shift < 32; shift += 7)
+	{
+		if (*pos >= t->size)
+			return false;
+
+		Uint8 byte = t->data[(*pos)++];
+		*count |= unsigned(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return *count > 0;
+	}
+	return false;
+}
+
+bool LoadTape(input_tape* t, const char* file)
+{
+	SDL_RWops* rw = SDL_RWFromFile(file, "rb");
+	if (rw == nullptr)
+		return false;
+
+	t->size = t->capacity = int(SDL_RWsize(rw));
+	t->data = (Uint8*)SDL_malloc(t->size);
+	bool ret = t->size > 0 && SDL_RWread(rw, t->data, 1, t->size) == size_t(t->size);
+	SDL_RWclose(rw);
+
+	ret = ret && t->size >= 6 && SDL_memcmp(t->data, TAPE_MAGIC, 4) == 0 && t->data[4] == TAPE_VERSION && t->data[5] == SIM_HZ;
+
+	// Every run has to be good, the replay can't go on from a broken one --
+	Uint8 mask;
+	unsigned count;
+	for (int pos = 6; ret && pos < t->size;)
+		ret = ReadRun(t, &pos, &mask, &count);
+	return ret;
+}
+
+void StartReader(tape_reader* r, const input_tape* t)
+{
+	SDL_memset(r, 0, sizeof(*r));
+	r->tape = t;
+	r->pos = 6; // skip header
+}
+
+// Feed next tick of input into the world, false when the tape is over
+bool ReplayInput(tape_reader* r, world* w)
+{
+	if (r->left == 0 && ReadRun(r->tape, &r->pos, &r->mask, &r->left) == false)
+		return false;
+
+	--r->left;
+	ApplyInput(w, r->mask);
+	return (r->mask & INPUT_QUIT) == 0;
+}
+
+// ----------------------------------------------------------------
+// Alive entities with min < x < max move by speed, the rest of them die
+template <int N>
+void MoveAndCull(int* x, slot_pool<N>* p, int speed, int min, int max)
+{
+	for (int i = 0; i < PADDED(N); i += SIMD_WIDTH)
+	{
+		unsigned lanes = (p->alive[i >> 5] >> (i & 31)) & 0xfu;
+		if (lanes == 0)
+			continue;
+
+#ifdef USE_SSE2
+		__m128i bits = _mm_set_epi32(8, 4, 2, 1);
+		__m128i live = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(lanes), bits), bits);
+		__m128i pos = _mm_loadu_si128((const __m128i*)&x[i]);
+		__m128i inside = _mm_and_si128(_mm_cmpgt_epi32(pos, _mm_set1_epi32(min)), _mm_cmplt_epi32(pos, _mm_set1_epi32(max)));
+		__m128i moving = _mm_and_si128(live, inside);
+		_mm_storeu_si128((__m128i*)&x[i], _mm_add_epi32(pos, _mm_and_si128(moving, _mm_set1_epi32(speed))));
+		unsigned survivors = unsigned(_mm_movemask_ps(_mm_castsi128_ps(moving)));
+#else
+		unsigned survivors = 0;
+		for (int k = 0; k < SIMD_WIDTH; ++k)
+		{
+			if (((lanes >> k) & 1u) && x[i + k] > min && x[i + k] < max)
+			{
+				x[i + k] += speed;
+				survivors |= 1u << k;
+			}
+		}
+#endif
+		ReleaseLanes(p, i, lanes & ~survivors);
+	}
+}
+
+// ----------------------------------------------------------------
+void SpawnExplosion(world* w, int x, int y)
+{
+	explosion_array* e = &w->explosions;
+	int i = Acquire(&e->pool);
+	if (i >= 0)
+	{
+		w->sounds |= SOUND_EXPLOSION;
+		e->expire[i] = w->tick + EXPLOSION_SPEED - 1;
+		ScheduleTimer(w, e->expire[i], OnExplosionTimer, i);
+		e->x[i] = e->prev_x[i] = x;
+		e->y[i] = e->prev_y[i] = y;
+	}
+}
+
+int GridColumn(int x)
+{
+	int column = (x - GRID_X) / SPRITE_SIZE - (x < GRID_X); // round down for negatives
+	return CAP(column, 0, GRID_W - 1);
+}
+
+int GridRow(int y)
+{
+	int row = (y - GRID_Y) / SPRITE_SIZE - (y < GRID_Y);
+	return CAP(row, 0, GRID_H - 1);
+}
+
+// Counting sort of live enemies by cell
+void BuildEnemyGrid(world* w)
+{
+	enemy_grid* grid = &w->grid;
+	const slot_pool<NUM_ENEMIES>* p = &w->enemies.pool;
+
+	SDL_memset(grid->start, 0, sizeof(grid->start));
+	for (int n = 0; n < p->num_live; ++n)
+	{
+		int i = p->live[n];
+		grid->cell[i] = Uint16(GridRow(w->enemies.y[i]) * GRID_W + GridColumn(w->enemies.x[i]));
+		++grid->start[grid->cell[i] + 1];
+	}
+
+	for (int c = 0; c < GRID_W * GRID_H; ++c)
+		grid->start[c + 1] += grid->start[c];
+
+	int fill[GRID_W * GRID_H];
+	SDL_memcpy(fill, grid->start, sizeof(fill));
+	for (int n = 0; n < p->num_live; ++n)
+	{
+		int i = p->live[n];
+		grid->items[fill[grid->cell[i]]++] = Uint16(i);
+	}
+}
+
+// Only looks at cells where an enemy overlapping rect could start, of all enemies hit it returns
+// the first one in the live list, same one a plain scan of all enemies would find --
+int CheckEnemyCollision(const world* w, SDL_Rect rect)
+{
+	const enemy_grid* grid = &w->grid;
+	int hit = -1;
+	int first_column = GridColumn(rect.x - SPRITE_SIZE + 1), last_column = GridColumn(rect.x + rect.w - 1);
+	int first_row = GridRow(rect.y - SPRITE_SIZE + 1), last_row = GridRow(rect.y + rect.h - 1);
+
+	for (int row = first_row; row <= last_row; ++row)
+	{
+		for (int c = row * GRID_W + first_column; c <= row * GRID_W + last_column; ++c)
+		{
+			for (int n = grid->start[c]; n < grid->start[c + 1]; ++n)
+			{
+				int k = grid->items[n];
+				SDL_Rect b = { w->enemies.x[k], w->enemies.y[k], SPRITE_SIZE, SPRITE_SIZE };
+				if (IsAlive(w->enemies.pool.alive, k) && SDL_HasIntersection(&rect, &b) &&
+					(hit < 0 || w->enemies.pool.where[k] < w->enemies.pool.where[hit]))
+					hit = k;
+			}
+		}
+	}
+	return hit;
+}
+
+void PushEvent(world* w, event_type type, int x, int y)
+{
+	if (w->num_events == MAX_EVENTS)
+		return; // can't happen, it is the most one tick can make
+
+	game_event* e = &w->events[w->num_events++];
+	e->type = type;
+	e->x = x;
+	e->y = y;
+}
+
+void KillEnemy(world* w, int id, event_type type)
+{
+	Release(&w->enemies.pool, id);
+	PushEvent(w, type, w->enemies.x[id], w->enemies.y[id]);
+	w->enemies.x[id] = -100;
+}
+
+// ----------------------------------------------------------------
+void UpdateShip(world* w, unsigned now)
+{
+	PROFILE("ship");
+
+	if (w->controls)
+	{
+		// Calc new ship position
+		w->ship_y += (-SHIP_SPEED * w->up) + (SHIP_SPEED * w->down);
+		w->ship_x += (-SHIP_SPEED * w->left) + (SHIP_SPEED * w->right);
+
+		// Limit position to current screen
+		CAP(w->ship_y, 0, SCREEN_HEIGHT - SPRITE_SIZE);
+		CAP(w->ship_x, 0, SCREEN_WIDTH - SPRITE_SIZE);
+
+		// Check if we need to spawn a new laser, unless all of them are still flying --
+		int shot;
+		if(w->fire && w->can_fire && (shot = Acquire(&w->shots.pool)) >= 0)
+		{
+			w->can_fire = false;
+			ScheduleTimer(w, now + MS_TO_TICKS(SHOT_TIMER), OnFireTimer, 0);
+			PushEvent(w, EVENT_SHOT, w->ship_x, w->ship_y);
+			w->fire = false;
+
+			w->shots.x[shot] = w->shots.prev_x[shot] = w->ship_x + SPRITE_SIZE/2;
+			w->shots.y[shot] = w->shots.prev_y[shot] = w->ship_y;
+		}
+	}
+	else if (w->intro)
+		w->ship_x += SHIP_SPEED;
+}
+
+// Move all lasers, the ones out of the screen die --
+void UpdateLasers(world* w)
+{
+	PROFILE("lasers");
+
+	MoveAndCull(w->shots.x, &w->shots.pool, SHOT_SPEED, INT_MIN, SCREEN_WIDTH);
+	for(int n = w->shots.pool.num_live - 1; n >= 0; --n) // backwards, releasing moves the last one here
+	{
+		int i = w->shots.pool.live[n];
+		int id_enemy = CheckEnemyCollision(w, { w->shots.x[i], w->shots.y[i], SPRITE_SIZE, SPRITE_SIZE });
+		if(id_enemy >= 0)
+		{
+			// we have a hit!
+			Release(&w->shots.pool, i);
+			KillEnemy(w, id_enemy, EVENT_KILL);
+		}
+	}
+}
+
+// Enemies of a wave come one after the other, then the wave timer starts again --
+void SpawnWave(world* w, unsigned now)
+{
+	PROFILE("wave spawn");
+
+	if (w->spawning)
+	{
+		if (w->wave_count == NUM_ENEMIES)
+		{
+			w->wave_count = 0;
+			w->spawning = false;
+			ScheduleTimer(w, now + MS_TO_TICKS(WAVE_TIMER), OnWaveTimer, 0);
+			w->spawn_height = SPRITE_SIZE + (now % (SCREEN_HEIGHT-SPRITE_SIZE-SPRITE_SIZE));
+		}
+		else if (w->wave_count == 0 || w->enemies.x[w->last_enemy] < SCREEN_WIDTH-SPRITE_SIZE)
+		{
+			int i = Acquire(&w->enemies.pool);
+			if (i >= 0)
+			{
+				w->enemies.x[i] = w->enemies.prev_x[i] = SCREEN_WIDTH;
+				w->enemies.y[i] = w->enemies.prev_y[i] = w->spawn_height;
+				w->last_enemy = i;
+				++w->wave_count;
+			}
+		}
+	}
+}
+
+// move all enemies, the ones out of the screen die --
+void MoveEnemies(world* w)
+{
+	PROFILE("enemy move");
+
+	MoveAndCull(w->enemies.x, &w->enemies.pool, -ENEMY_SPEED, -SPRITE_SIZE, INT_MAX);
+	for(int n = 0; n < w->enemies.pool.num_live; ++n)
+	{
+		int i = w->enemies.pool.live[n];
+		int x = w->enemies.x[i];
+		CAP(x, WAVE_MIN_X, WAVE_MAX_X);
+		w->enemies.y[i] += enemy_wave.dy[x - WAVE_MIN_X];
+	}
+
+	// enemies stay put until next tick, so the grid also serves next tick's lasers --
+	BuildEnemyGrid(w);
+}
+
+// Check player-enemy collision --
+void CheckShipCollision(world* w)
+{
+	PROFILE("collision");
+
+	if (w->invulnerable == false)
+	{
+		int id_enemy = CheckEnemyCollision(w, { w->ship_x, w->ship_y, SPRITE_SIZE, SPRITE_SIZE });
+		if (id_enemy >= 0)
+		{
+			// we have been hit!
+			KillEnemy(w, id_enemy, EVENT_CRASH);
+			PushEvent(w, EVENT_HIT, w->ship_x, w->ship_y);
+			StartIntro(w);
+			w->ship_x = w->prev_ship_x = -SPRITE_SIZE * 4;
+			w->ship_y = w->prev_ship_y = SCREEN_HEIGHT / 2;
+		}
+	}
+}
+
+// In the same order they happened, so explosions take the same slots every run --
+void ApplyEvents(world* w)
+{
+	PROFILE("events");
+
+	w->sounds = 0;
+	for (int n = 0; n < w->num_events; ++n)
+	{
+		const game_event* e = &w->events[n];
+		switch (e->type)
+		{
+			case EVENT_SHOT: w->sounds |= SOUND_SHOOT; break;
+			case EVENT_KILL: w->score += KILL_SCORE; SpawnExplosion(w, e->x, e->y); break;
+			case EVENT_CRASH: SpawnExplosion(w, e->x, e->y); break;
+			case EVENT_HIT: w->score = 0; SpawnExplosion(w, e->x, e->y); break;
+		}
+	}
+	w->num_events = 0;
+}
+
+void UpdateWorld(world* w)
+{
+	PROFILE("UpdateWorld");
+	unsigned now = ++w->tick;
+
+	// Keep last tick's positions so Draw() can interpolate --
+	w->prev_ship_x = w->ship_x;
+	w->prev_ship_y = w->ship_y;
+	w->prev_scroll = w->scroll;
+	SDL_memcpy(w->shots.prev_x, w->shots.x, sizeof(w->shots.x));
+	SDL_memcpy(w->shots.prev_y, w->shots.y, sizeof(w->shots.y));
+	SDL_memcpy(w->enemies.prev_x, w->enemies.x, sizeof(w->enemies.x));
+	SDL_memcpy(w->enemies.prev_y, w->enemies.y, sizeof(w->enemies.y));
+	SDL_memcpy(w->explosions.prev_x, w->explosions.x, sizeof(w->explosions.x));
+	SDL_memcpy(w->explosions.prev_y, w->explosions.y, sizeof(w->explosions.y));
+
+	w->scroll += SCROLL_SPEED;
+
+	UpdateShip(w, now);
+	UpdateLasers(w);
+	SpawnWave(w, now);
+	MoveEnemies(w);
+	CheckShipCollision(w);
+	ApplyEvents(w);
+	RunTimers(w);
+
+	// check max score
+	if (w->score > w->max_score)
+		w->max_score = w->score;
+}
+
+// ----------------------------------------------------------------
+// dst = src + dst * (255 - src alpha), both premultiplied
+void BlendSpan(Uint32* dst, const Uint32* src, int count)
+{
+	int i = 0;
+#ifdef USE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(128);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i alpha = _mm_srli_epi32(s, 24);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) == 0xffff)
+			continue; // all four transparent
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_set1_epi32(255))) == 0xffff)
+		{
+			_mm_storeu_si128((__m128i*)&dst[i], s);
+			continue;
+		}
+
+		// 255 - alpha in the four bytes of each pixel, then same rounding as Mul255() in 16 bit lanes
+		__m128i inv = _mm_sub_epi32(_mm_set1_epi32(255), alpha);
+		inv = _mm_or_si128(inv, _mm_slli_epi32(inv, 8));
+		inv = _mm_or_si128(inv, _mm_slli_epi32(inv, 16));
+
+		__m128i d = _mm_loadu_si128((const __m128i*)&dst[i]);
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv, zero)), round);
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero)), round);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i*)&dst[i], _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		Uint32 s = src[i], d = dst[i];
+		Uint32 inv = 255 - (s >> 24);
+		dst[i] = s + ((Mul255(d >> 24, inv) << 24) | (Mul255((d >> 16) & 255, inv) << 16) | (Mul255((d >> 8) & 255, inv) << 8) | Mul255(d & 255, inv));
+	}
+}
+
+// Draw the part inside clip into the framebuffer, scaling picks the nearest pixel like SDL does by default.
+// Every pixel only depends on its own position, so drawing by tiles gives the same result as all at once --
+void SoftCopy(const soft_image* image, const SDL_Rect* source, const SDL_Rect* target, SDL_RendererFlip flip, const SDL_Rect* clip)
+{
+	SDL_Rect src = { 0, 0, image->width, image->height };
+	if (source != nullptr && SDL_IntersectRect(source, &src, &src) == SDL_FALSE)
+		return;
 
-// Macros --------------------------------------------------------
-#define CAP(value, min, max) (value = (value<min) ? min : ((value>max) ? max : value));
+	int x0 = SDL_max(target->x, clip->x);
+	int x1 = SDL_min(target->x + target->w, clip->x + clip->w);
+	int y0 = SDL_max(target->y, clip->y);
+	int y1 = SDL_min(target->y + target->h, clip->y + clip->h);
+	if (x0 >= x1 || y0 >= y1)
+		return;
 
-const char* tex_layers[NUM_LAYERS] = { 
-	ASSETS_DIR "bg0.png", ASSETS_DIR "bg1.png", ASSETS_DIR "bg2.png", ASSETS_DIR "bg3.png", ASSETS_DIR "fg.png" };
+	// Rows of the same size and not flipped are read in place, the rest gathered first --
+	int width = x1 - x0;
+	bool direct = src.w == target->w && (flip & SDL_FLIP_HORIZONTAL) == 0;
+	int columns[SCREEN_WIDTH];
+	Uint32 row[SCREEN_WIDTH];
+	for (int x = 0; x < width; ++x)
+	{
+		int u = (x0 + x - target->x) * src.w / target->w;
+		columns[x] = src.x + ((flip & SDL_FLIP_HORIZONTAL) ? src.w - 1 - u : u);
+	}
 
-struct explosion
+	for (int y = y0; y < y1; ++y)
+	{
+		int v = (y - target->y) * src.h / target->h;
+		const Uint32* in = image->pixels + (src.y + ((flip & SDL_FLIP_VERTICAL) ? src.h - 1 - v : v)) * image->width;
+		const Uint32* span = in + columns[0];
+		if (direct == false)
+		{
+			for (int x = 0; x < width; ++x)
+				row[x] = in[columns[x]];
+			span = row;
+		}
+
+		Uint32* out = g.soft.pixels + y * SCREEN_WIDTH + x0;
+		if (image->opaque)
+			SDL_memcpy(out, span, width * 4);
+		else
+			BlendSpan(out, span, width);
+	}
+}
+
+void RenderCopy(SDL_Texture* texture, const soft_image* image, const SDL_Rect* source, const SDL_Rect* target, SDL_RendererFlip flip)
 {
-	bool alive;
-	int lifetime;
-	int x, y;
-};
+	if (g.software)
+	{
+		SDL_Rect screen = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+		if (image != nullptr)
+			SoftCopy(image, source, target, flip, &screen);
+	}
+	else if (flip == SDL_FLIP_NONE)
+		SDL_RenderCopy(g.renderer, texture, source, target);
+	else
+		SDL_RenderCopyEx(g.renderer, texture, source, target, 0.0, nullptr, flip);
+}
 
-struct enemy
+// Record a copy for this frame, source null for the whole texture
+void PushCopy(int depth, SDL_Texture* texture, const soft_image* image, const SDL_Rect* source, const SDL_Rect* target, SDL_RendererFlip flip)
 {
-	bool alive;
-	int x, y;
-};
+	if (depth == DEPTH_IMMEDIATE)
+	{
+		RenderCopy(texture, image, source, target, flip);
+		return;
+	}
 
-struct parallax
+	render_buffer* r = &g.render;
+	if (r->count == MAX_RENDER_COMMANDS)
+	{
+		++r->dropped;
+		return;
+	}
+
+	render_command* c = &r->commands[r->count];
+	c->texture = texture;
+	c->image = image;
+	c->source = source ? *source : SDL_Rect{ 0, 0, 0, 0 };
+	c->target = *target;
+	c->flip = flip;
+	c->depth = depth;
+	c->order = r->count++;
+}
+
+int CompareCommands(const void* a, const void* b)
 {
-	int width, height;
-	SDL_Texture* texture;
-};
+	const render_command* x = (const render_command*)a;
+	const render_command* y = (const render_command*)b;
+
+	if (x->depth != y->depth)
+		return x->depth - y->depth;
+	if (x->texture != y->texture)
+		return (x->texture < y->texture) ? -1 : 1;
+	if (x->image != y->image)
+		return (x->image < y->image) ? -1 : 1;
+	return x->order - y->order;
+}
 
-struct projectile
+// Add each sorted command to the list of every tile its target touches
+void BinCommands(const render_buffer* r, tile_bins* b)
 {
-	int x, y;
-	bool alive;
-};
+	PROFILE("bin");
 
-struct globals
+	SDL_memset(b->count, 0, sizeof(b->count));
+	for (int i = 0; i < r->count; ++i)
+	{
+		const render_command* c = &r->commands[i];
+		int x0 = SDL_max(c->target.x, 0);
+		int x1 = SDL_min(c->target.x + c->target.w, SCREEN_WIDTH);
+		int y0 = SDL_max(c->target.y, 0);
+		int y1 = SDL_min(c->target.y + c->target.h, SCREEN_HEIGHT);
+		if (c->image == nullptr || x0 >= x1 || y0 >= y1)
+			continue;
+
+		for (int ty = y0 / TILE_H; ty <= (y1 - 1) / TILE_H; ++ty)
+		{
+			for (int tx = x0 / TILE_W; tx <= (x1 - 1) / TILE_W; ++tx)
+			{
+				int tile = ty * TILES_X + tx;
+				b->commands[tile][b->count[tile]++] = Uint16(i);
+			}
+		}
+	}
+}
+
+void RasterTileJob(void* data, int index)
 {
-	SDL_Window* window;
-	SDL_Renderer* renderer;
-	SDL_Texture* ship;
-	SDL_Texture* shot;
-	SDL_Texture* tex_enemy;
-	SDL_Texture* tex_explosion;
-	int ship_x, ship_y;
-	int last_shot, last_enemy;
-	int fire, up, down, left, right;
-	int scroll;
-	int score, max_score;
-	int frame;
-	unsigned wave_timer, intro_timer, intro_free_timer, shot_timer;
-	Mix_Music* music;
-	Mix_Chunk* fx_shoot;
-	Mix_Chunk* fx_explosion;
-	SDL_Texture* tex_max;
-	struct
+	const render_buffer* r = (const render_buffer*)data;
+	const tile_bins* b = &g.soft.bins;
+
+	SDL_Rect clip = { (index % TILES_X) * TILE_W, (index / TILES_X) * TILE_H, TILE_W, TILE_H };
+	clip.w = SDL_min(clip.w, SCREEN_WIDTH - clip.x);
+	clip.h = SDL_min(clip.h, SCREEN_HEIGHT - clip.y);
+
+	for (int y = clip.y; y < clip.y + clip.h; ++y)
+		SDL_memset(g.soft.pixels + y * SCREEN_WIDTH + clip.x, 0, clip.w * 4);
+
+	for (int i = 0; i < b->count[index]; ++i)
 	{
-		SDL_Texture* tex;
-		int w, h;
-	} font;
-	projectile shots[NUM_SHOTS];
-	parallax layers[NUM_LAYERS];
-	enemy enemies[NUM_ENEMIES];
-	explosion explosions[NUM_EXPLOSIONS];
-} g; // automatically create an insteance called "g"
+		const render_command* c = &r->commands[b->commands[index][i]];
+		SoftCopy(c->image, c->source.w ? &c->source : nullptr, &c->target, c->flip, &clip);
+	}
+}
 
-// ----------------------------------------------------------------
-void Start()
+// Sort all recorded copies and send them to the renderer in one pass
+void FlushCommands(render_buffer* r)
 {
-	SDL_Init(SDL_INIT_EVERYTHING);
-	SDL_memset(&g, 0, sizeof(g)); // Clear g to 0/null
+	PROFILE("flush");
 
-	// Create window & renderer
-	g.window = SDL_CreateWindow("QSS - 0.7", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH, SCREEN_HEIGHT, 0);
-	g.renderer = SDL_CreateRenderer(g.window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	qsort(r->commands, r->count, sizeof(render_command), CompareCommands);
 
-	// Load image lib --
-	IMG_Init(IMG_INIT_PNG);
-	for (int i = 0; i < NUM_LAYERS; ++i)
+	if (g.software)
+	{
+		// Tiles never share pixels so all cores can draw them at once, then only the finished frame goes to SDL --
+		BinCommands(r, &g.soft.bins);
+		{
+			PROFILE("raster tiles");
+			RunJobs(&g.pool, RasterTileJob, r, NUM_TILES);
+		}
+		SDL_UpdateTexture(g.soft.screen, nullptr, g.soft.pixels, SCREEN_WIDTH * 4);
+		SDL_RenderCopy(g.renderer, g.soft.screen, nullptr, nullptr);
+	}
+	else
 	{
-		g.layers[i].texture = SDL_CreateTextureFromSurface(g.renderer, IMG_Load(tex_layers[i]));
-		SDL_QueryTexture(g.layers[i].texture, nullptr, nullptr, &g.layers[i].width, &g.layers[i].height);
+		for (int i = 0; i < r->count; ++i)
+		{
+			const render_command* c = &r->commands[i];
+			RenderCopy(c->texture, c->image, c->source.w ? &c->source : nullptr, &c->target, c->flip);
+		}
 	}
-	g.ship = SDL_CreateTextureFromSurface(g.renderer, IMG_Load(ASSETS_DIR "ship.png"));
-	g.shot = SDL_CreateTextureFromSurface(g.renderer, IMG_Load(ASSETS_DIR "shot.png"));
-	g.tex_explosion = SDL_CreateTextureFromSurface(g.renderer, IMG_Load(ASSETS_DIR "explosion.png"));
-	g.tex_enemy = SDL_CreateTextureFromSurface(g.renderer, IMG_Load(ASSETS_DIR "enemy.png"));
-	g.tex_max = SDL_CreateTextureFromSurface(g.renderer, IMG_Load(ASSETS_DIR "max.png"));
-	g.font.tex = SDL_CreateTextureFromSurface(g.renderer, IMG_Load(ASSETS_DIR "font.png"));
-	SDL_QueryTexture(g.font.tex, nullptr, nullptr, &g.font.w, &g.font.h);
-	g.font.w /= 10; // w,h are for every single letter, this font should have "0123456789"
 
-	// Create mixer --
-	Mix_Init(MIX_INIT_OGG);
-	Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048);
-	g.music = Mix_LoadMUS(ASSETS_DIR "music.ogg");
-	Mix_PlayMusic(g.music, -1);
-	g.fx_shoot = Mix_LoadWAV(ASSETS_DIR "laser.wav");
-	g.fx_explosion = Mix_LoadWAV(ASSETS_DIR "explosion.wav");
+	ProfileCounter("render commands", r->count);
+	if (r->dropped > 0)
+		SDL_Log("Render buffer full, %d copies dropped", r->dropped);
 
-	// Init other vars --
-	g.ship_x = -SPRITE_SIZE * 3;
-	g.ship_y = SCREEN_HEIGHT / 2;
-	g.wave_timer = g.intro_timer = g.shot_timer = SDL_GetTicks();
-	g.intro_free_timer = SDL_GetTicks() + INTRO_FREE_TIMER;
+	r->count = 0;
+	r->dropped = 0;
 }
 
-// ----------------------------------------------------------------
-void Finish()
+// section is relative to the sprite region, null for the whole sprite
+void DrawSprite(int depth, int id, const SDL_Rect* section, const SDL_Rect* target)
 {
-	Mix_FreeMusic(g.music);
-	Mix_FreeChunk(g.fx_shoot);
-	Mix_FreeChunk(g.fx_explosion);
-	Mix_CloseAudio();
-	Mix_Quit();
+	const sprite_region* region = &atlas_regions[id];
+	SDL_Rect source = region->rect;
+	if (section != nullptr)
+		source = { source.x + section->x, source.y + section->y, section->w, section->h };
 
-	for(int i = 0; i < NUM_LAYERS; ++i) 
-		SDL_DestroyTexture(g.layers[i].texture);
-	SDL_DestroyTexture(g.ship);
-	SDL_DestroyTexture(g.shot);
-	SDL_DestroyTexture(g.tex_explosion);
-	SDL_DestroyTexture(g.tex_enemy);
-	SDL_DestroyTexture(g.tex_max);
-	SDL_DestroyTexture(g.font.tex);
-	IMG_Quit();
+	PushCopy(depth, GetTexture(g.atlas), GetImage(g.atlas), &source, target, region->flip);
+}
 
-	SDL_DestroyRenderer(g.renderer);
-	SDL_DestroyWindow(g.window);
-	SDL_Quit();
+// Any string, chars missing from the font are left blank
+void DrawString(int depth, int x, int y, const char* text)
+{
+	for (; *text != '\0'; ++text, x += g.font.w)
+	{
+		const SDL_Rect* section = &g.font.glyphs[*text & 127];
+		if (section->w == 0)
+			continue;
+
+		SDL_Rect target = { x, y, g.font.w, g.font.h };
+		DrawSprite(depth, SPRITE_FONT, section, &target);
+	}
+}
+
+void DrawNumber(int depth, int x, int y, int number)
+{
+	char text[8];
+	SDL_snprintf(text, sizeof(text), "%05d", number % 100000);
+	DrawString(depth, x, y, text);
+}
+
+// Blend from last tick's value to current one, alpha in [0..1]
+int Lerp(int prev, int current, float alpha)
+{
+	return prev + int((current - prev) * alpha);
 }
 
 // ----------------------------------------------------------------
-bool CheckInput()
+// Scroll and draw all parallax layers --
+void DrawLayers(const world_snapshot* w, float alpha)
 {
-	bool ret = true;
-	SDL_Event event;
+	PROFILE("layers");
 
-	while(SDL_PollEvent(&event) != 0)
+	int scroll = Lerp(w->prev_scroll, w->scroll, alpha);
+	for (int i = 0; i < NUM_LAYERS; ++i)
 	{
-		if (event.type == SDL_KEYUP || event.type == SDL_KEYDOWN)
+		parallax* p = &g.layers[i];
+		SDL_Texture* texture = GetTexture(p->texture);
+		const soft_image* image = GetImage(p->texture);
+		if ((texture == nullptr && image == nullptr) || p->width <= 0)
+			continue;
+
+		// Copy only the spans of the texture that are on screen, each screen column once --
+		SDL_Rect section = { int(Sint64(scroll) * p->speed % p->width), 0, 0, p->height };
+		SDL_Rect target = { 0, SCREEN_HEIGHT - p->height, 0, p->height };
+		while (target.x < SCREEN_WIDTH)
 		{
-			switch(event.key.keysym.sym)
-			{
-				case SDLK_w: g.up = (event.type == SDL_KEYDOWN); break;
-				case SDLK_s: g.down = (event.type == SDL_KEYDOWN); break;
-				case SDLK_a: g.left = (event.type == SDL_KEYDOWN); break;
-				case SDLK_d: g.right = (event.type == SDL_KEYDOWN); break;
-				case SDLK_SPACE: g.fire = (event.type == SDL_KEYDOWN); break;
-				case SDLK_ESCAPE: ret = false; break;
-			}
+			section.w = target.w = SDL_min(p->width - section.x, SCREEN_WIDTH - target.x);
+			PushCopy(DEPTH_LAYERS + i, texture, image, &section, &target, SDL_FLIP_NONE);
+			target.x += target.w;
+			section.x = 0;
 		}
-		else if (event.type == SDL_QUIT)
-			ret = false;
 	}
+}
 
-	return ret;
+// Visibility pass, sprites fully outside the screen never reach the renderer --
+bool OnScreen(const SDL_Rect* target)
+{
+	bool visible = target->x < SCREEN_WIDTH && target->x + target->w > 0 && target->y < SCREEN_HEIGHT && target->y + target->h > 0;
+	if (visible)
+		++g.sprites.submitted;
+	else
+		++g.sprites.culled;
+	return visible;
 }
 
-void SpawnExplosion(int x, int y)
+// Draw player's ship --
+void DrawShip(const world_snapshot* w, float alpha)
 {
-	for (int i = 0; i < NUM_EXPLOSIONS; ++i)
+	PROFILE("ship");
+
+	if (w->ship_blinking == false || g.frame % 2)
 	{
-		if (g.explosions[i].alive == false)
-		{
-			Mix_PlayChannel(-1, g.fx_explosion, 0);
-			g.explosions[i].alive = true;
-			g.explosions[i].lifetime = EXPLOSION_SPEED;
-			g.explosions[i].x = x;
-			g.explosions[i].y = y;
-			break;
-		}
+		SDL_Rect target = { Lerp(w->prev_ship_x, w->ship_x, alpha), Lerp(w->prev_ship_y, w->ship_y, alpha), SPRITE_SIZE, SPRITE_SIZE };
+		if (OnScreen(&target))
+			DrawSprite(DEPTH_SHIP, SPRITE_SHIP, nullptr, &target);
 	}
 }
 
-int CheckEnemyCollision(SDL_Rect rect)
+void DrawSprites(int depth, int id, const sprite_state* sprites, int count, float alpha)
 {
-	for (int k = 0; k < NUM_ENEMIES; ++k)
+	for(int i = 0; i < count; ++i)
 	{
-		SDL_Rect b = { g.enemies[k].x, g.enemies[k].y, SPRITE_SIZE, SPRITE_SIZE };
-		if (g.enemies[k].alive && SDL_HasIntersection(&rect, &b))
-			return k;
+		const sprite_state* s = &sprites[i];
+		SDL_Rect target = { Lerp(s->prev_x, s->x, alpha), Lerp(s->prev_y, s->y, alpha), SPRITE_SIZE, SPRITE_SIZE };
+		if (OnScreen(&target) == false)
+			continue;
+
+		SDL_Rect section = { SPRITE_SIZE * s->frame, 0, SPRITE_SIZE, SPRITE_SIZE };
+		DrawSprite(depth, id, (id == SPRITE_EXPLOSION) ? &section : nullptr, &target);
 	}
-	return -1;
 }
 
-void KillEnemy(int id)
+// Draw lasers --
+void DrawLasers(const world_snapshot* w, float alpha)
 {
-	g.enemies[id].alive = false;
-	SpawnExplosion(g.enemies[id].x, g.enemies[id].y);
-	g.enemies[id].x = -100;
+	PROFILE("lasers");
+	DrawSprites(DEPTH_LASERS, SPRITE_SHOT, w->shots, w->num_shots, alpha);
 }
 
-// ----------------------------------------------------------------
-void UpdateWorld(unsigned int now)
+// Draw enemies ---
+void DrawEnemies(const world_snapshot* w, float alpha)
 {
-	if (g.intro_timer == 0u && g.intro_free_timer == 0u)
-	{
-		// Calc new ship position
-		g.ship_y += (-SHIP_SPEED * g.up) + (SHIP_SPEED * g.down);
-		g.ship_x += (-SHIP_SPEED * g.left) + (SHIP_SPEED * g.right);
+	PROFILE("enemies");
+	DrawSprites(DEPTH_ENEMIES, SPRITE_ENEMY, w->enemies, w->num_enemies, alpha);
+}
 
-		// Limit position to current screen
-		CAP(g.ship_y, 0, SCREEN_HEIGHT - SPRITE_SIZE);
-		CAP(g.ship_x, 0, SCREEN_WIDTH - SPRITE_SIZE);
+// Draw explosions --
+void DrawExplosions(const world_snapshot* w, float alpha)
+{
+	PROFILE("explosions");
+	DrawSprites(DEPTH_EXPLOSIONS, SPRITE_EXPLOSION, w->explosions, w->num_explosions, alpha);
+}
 
-		// Check if we need to spawn a new laser --
-		if(g.fire && (now - g.shot_timer) > SHOT_TIMER)
-		{
-			g.shot_timer = now;
-			Mix_PlayChannel(-1, g.fx_shoot, 0);
-			g.fire = false;
+// Draw "MAX" label and score numbers --
+void DrawHudContents(int depth, const world_snapshot* w, int x, int y)
+{
+	SDL_Rect target = { x, y, g.font.w*3, g.font.h };
+	DrawSprite(depth, SPRITE_MAX, nullptr, &target);
 
-			if(g.last_shot == NUM_SHOTS)
-				g.last_shot = 0;
+	DrawNumber(depth, x + 10 + g.font.w*3, y, w->max_score);
+	DrawNumber(depth, x + 10 + g.font.w*3, y + 10 + g.font.h, w->score);
+}
 
-			g.shots[g.last_shot].alive = true;
-			g.shots[g.last_shot].x = g.ship_x + SPRITE_SIZE/2;
-			g.shots[g.last_shot].y = g.ship_y;
-			++g.last_shot;
-		}
-	}
-	else if (g.intro_timer > 0u)
+void DrawHud(const world_snapshot* w)
+{
+	PROFILE("hud");
+
+	if (g.hud.texture == nullptr)
 	{
-		g.ship_x += SHIP_SPEED;
-		if (now - g.intro_timer > INTRO_TIMER)
-			g.intro_timer = 0u;
+		DrawHudContents(DEPTH_HUD, w, g.hud.target.x, g.hud.target.y);
+		return;
 	}
-	else if (g.intro_free_timer > 0u && now - g.intro_free_timer > INTRO_FREE_TIMER)
-		g.intro_free_timer = 0u;
 
-	// Move all lasers --
-	for(int i = 0; i < NUM_SHOTS; ++i)
+	if (g.hud.valid == false || g.hud.score != w->score || g.hud.max_score != w->max_score)
 	{
-		if(g.shots[i].alive)
-		{
-			if (g.shots[i].x < SCREEN_WIDTH)
-			{
-				g.shots[i].x += SHOT_SPEED;
-				int id_enemy = CheckEnemyCollision({ g.shots[i].x, g.shots[i].y, SPRITE_SIZE, SPRITE_SIZE });
-				if(id_enemy >= 0)
-				{
-					// we have a hit!
-					g.shots[i].alive = false;
-					KillEnemy(id_enemy);
-					g.score += KILL_SCORE;
-				}
-			}
-			else
-				g.shots[i].alive = false;
-		}
+		PROFILE("hud rebuild");
+
+		// Glyphs never overlap, so they are copied with their alpha as is and blended once on screen --
+		SDL_Texture* atlas = GetTexture(g.atlas);
+		SDL_SetRenderTarget(g.renderer, g.hud.texture);
+		SDL_SetRenderDrawColor(g.renderer, 0, 0, 0, 0);
+		SDL_RenderClear(g.renderer);
+		SDL_SetTextureBlendMode(atlas, SDL_BLENDMODE_NONE);
+		DrawHudContents(DEPTH_IMMEDIATE, w, 0, 0);
+		SDL_SetTextureBlendMode(atlas, SDL_BLENDMODE_BLEND);
+		SDL_SetRenderTarget(g.renderer, nullptr);
+
+		g.hud.score = w->score;
+		g.hud.max_score = w->max_score;
+		g.hud.valid = true;
 	}
 
-	// Wave timer to decide to spawn enemies of not --
-	static int spawn_height = 100;
-	if (now - g.wave_timer > WAVE_TIMER)
+	PushCopy(DEPTH_HUD, g.hud.texture, nullptr, nullptr, &g.hud.target, SDL_FLIP_NONE);
+}
+
+void Draw(const world_snapshot* w)
+{
+	float alpha = w->alpha;
+	g.sprites.submitted = g.sprites.culled = 0;
 	{
-		if (g.last_enemy == NUM_ENEMIES)
-		{
-			g.last_enemy = 0;
-			g.wave_timer = SDL_GetTicks();
-			spawn_height = SPRITE_SIZE + (g.frame % (SCREEN_HEIGHT-SPRITE_SIZE-SPRITE_SIZE));
-		}
-		else if (g.last_enemy == 0 || g.enemies[g.last_enemy-1].x < SCREEN_WIDTH-SPRITE_SIZE)
-		{
-			g.enemies[g.last_enemy].alive = true;
-			g.enemies[g.last_enemy].x = SCREEN_WIDTH;
-			g.enemies[g.last_enemy].y = spawn_height;
-			++g.last_enemy;
-		}
+		PROFILE("Draw");
+		DrawLayers(w, alpha);
+		DrawShip(w, alpha);
+		DrawLasers(w, alpha);
+		DrawEnemies(w, alpha);
+		DrawExplosions(w, alpha);
+		DrawHud(w);
+		FlushCommands(&g.render);
 	}
-	
-	// move all enemies --
-	for(int i = 0; i < NUM_ENEMIES; ++i)
+	g.sprites.total_submitted += g.sprites.submitted;
+	g.sprites.total_culled += g.sprites.culled;
+	ProfileCounter("sprites submitted", g.sprites.submitted);
+	ProfileCounter("sprites culled", g.sprites.culled);
+
+	// Finally swap buffers --
+	PROFILE("SDL_RenderPresent");
+	SDL_RenderPresent(g.renderer);
+}
+
+// ----------------------------------------------------------------
+void CopySprites(sprite_state* out, const int* x, const int* y, const int* prev_x, const int* prev_y, const Uint16* live, int count)
+{
+	for (int n = 0; n < count; ++n)
 	{
-		if(g.enemies[i].alive)
-		{
-			if (g.enemies[i].x > -SPRITE_SIZE)
-			{
-				g.enemies[i].x -= ENEMY_SPEED;
-				g.enemies[i].y += int(SDL_sinf((float)g.enemies[i].x/(SCREEN_WIDTH/20)) * 4);
-			}
-			else
-				g.enemies[i].alive = false;
-		}
+		int i = live[n];
+		out[n] = { x[i], y[i], prev_x[i], prev_y[i], 0 };
 	}
+}
+
+// Only positions of live entities, no need to copy pools or the grid
+void TakeSnapshot(const world* w, world_snapshot* out)
+{
+	PROFILE("snapshot");
+
+	out->ship_x = w->ship_x;
+	out->ship_y = w->ship_y;
+	out->prev_ship_x = w->prev_ship_x;
+	out->prev_ship_y = w->prev_ship_y;
+	out->ship_blinking = w->invulnerable;
+	out->scroll = w->scroll;
+	out->prev_scroll = w->prev_scroll;
+	out->score = w->score;
+	out->max_score = w->max_score;
+
+	out->num_shots = w->shots.pool.num_live;
+	CopySprites(out->shots, w->shots.x, w->shots.y, w->shots.prev_x, w->shots.prev_y, w->shots.pool.live, out->num_shots);
+	out->num_enemies = w->enemies.pool.num_live;
+	CopySprites(out->enemies, w->enemies.x, w->enemies.y, w->enemies.prev_x, w->enemies.prev_y, w->enemies.pool.live, out->num_enemies);
+	out->num_explosions = w->explosions.pool.num_live;
+	CopySprites(out->explosions, w->explosions.x, w->explosions.y, w->explosions.prev_x, w->explosions.prev_y, w->explosions.pool.live, out->num_explosions);
+	for (int n = 0; n < out->num_explosions; ++n)
+		out->explosions[n].frame = int(w->explosions.expire[w->explosions.pool.live[n]] - w->tick) / (EXPLOSION_SPEED/5);
+}
 
-	// Check player-enemy collision --
-	if (g.intro_free_timer == 0u)
+// One batch of ticks with the input gathered last frame, then a snapshot for the main thread to draw
+void RunSimBatch(sim_thread* s)
+{
+	ApplyKeys(&g.game, &s->input);
+	Uint32 sounds = 0; // the same sound from ticks of one batch would be heard at once anyway
+	for (int i = 0; i < s->steps; ++i)
 	{
-		int id_enemy = CheckEnemyCollision({ g.ship_x, g.ship_y, SPRITE_SIZE, SPRITE_SIZE });
-		if (id_enemy >= 0)
+		if (s->replay != nullptr && ReplayInput(s->replay, &g.game) == false)
 		{
-			// we have been hit!
-			KillEnemy(id_enemy);
-			SpawnExplosion(g.ship_x, g.ship_y);
-			g.score = 0;
-			g.intro_timer = SDL_GetTicks();
-			g.intro_free_timer = now + INTRO_FREE_TIMER;
-			g.ship_x = -SPRITE_SIZE * 4;
-			g.ship_y = SCREEN_HEIGHT / 2;
+			s->finished = true;
+			break;
 		}
+		else if (s->record != nullptr)
+			RecordInput(s->record, InputMask(&g.game));
+
+		UpdateWorld(&g.game);
+		sounds |= g.game.sounds;
 	}
+	if (g.latency.enabled && (sounds & SOUND_SHOOT) != 0)
+		ListenForLaser(&g.latency); // before it is queued, the capture callback can't miss it
+	PlaySounds(sounds);
+	TakeSnapshot(&g.game, &s->snapshots[s->front ^ 1]);
+}
 
-	// cycle explosions
-	for (int i = 0; i < NUM_EXPLOSIONS; ++i)
+int SimThread(void* data)
+{
+	sim_thread* s = (sim_thread*)data;
+
+	SDL_LockMutex(s->lock);
+	for (;;)
 	{
-		if (g.explosions[i].alive && --g.explosions[i].lifetime <= 0)
-			g.explosions[i].alive = false;
+		while (s->busy == false && s->quit == false)
+			SDL_CondWait(s->wake, s->lock);
+		if (s->quit)
+			break;
+
+		SDL_UnlockMutex(s->lock);
+		RunSimBatch(s);
+		SDL_LockMutex(s->lock);
+
+		s->busy = false;
+		SDL_CondSignal(s->done);
 	}
+	SDL_UnlockMutex(s->lock);
+	return 0;
+}
 
-	// check max score
-	if (g.score > g.max_score)
-		g.max_score = g.score;
+// Block until the running batch is done, then its snapshot becomes the front one
+world_snapshot* WaitSim(sim_thread* s)
+{
+	PROFILE("wait simulation");
+
+	SDL_LockMutex(s->lock);
+	while (s->busy)
+		SDL_CondWait(s->done, s->lock);
+	SDL_UnlockMutex(s->lock);
+
+	s->front ^= 1;
+	return &s->snapshots[s->front];
 }
 
-void DrawNumber(int x, int y, int number)
+// Start simulating next frame, alpha is for when its snapshot gets drawn
+void KickSim(sim_thread* s, int steps, input_state* in, float alpha)
 {
-	for (int i = 4; i >= 0; --i)
-	{
-		SDL_Rect target = { x + (g.font.w * i) , y, g.font.w, g.font.h };
-		SDL_Rect section = { (number % 10) * g.font.w, 0, g.font.w, g.font.h };
-		SDL_RenderCopy(g.renderer, g.font.tex, &section, &target);
-		number /= 10;
-	}
+	SDL_LockMutex(s->lock);
+	s->steps = steps;
+	s->input = *in;
+	s->snapshots[s->front ^ 1].alpha = alpha;
+	s->busy = true;
+	SDL_CondSignal(s->wake);
+	SDL_UnlockMutex(s->lock);
+
+	in->fire_pressed = false;
+}
+
+void StartSim(sim_thread* s, tape_reader* replay, input_tape* record)
+{
+	s->lock = SDL_CreateMutex();
+	s->wake = SDL_CreateCond();
+	s->done = SDL_CreateCond();
+	s->replay = replay;
+	s->record = record;
+	s->front = 1;
+	TakeSnapshot(&g.game, &s->snapshots[0]); // first frame draws the initial state
+	s->thread = SDL_CreateThread(SimThread, "simulation", s);
+}
+
+void StopSim(sim_thread* s)
+{
+	WaitSim(s);
+
+	SDL_LockMutex(s->lock);
+	s->quit = true;
+	SDL_CondSignal(s->wake);
+	SDL_UnlockMutex(s->lock);
+
+	SDL_WaitThread(s->thread, nullptr);
+	SDL_DestroyCond(s->done);
+	SDL_DestroyCond(s->wake);
+	SDL_DestroyMutex(s->lock);
+}
+
+// Hash of the simulation state, two runs with same input must match
+unsigned WorldChecksum(const world* w)
+{
+	unsigned hash = 2166136261u; // FNV-1a
+	int values[] = { w->ship_x, w->ship_y, w->score, w->max_score, int(w->tick), w->wave_count, w->last_enemy };
+	for (int i = 0; i < int(SDL_arraysize(values)); ++i)
+		hash = (hash ^ unsigned(values[i])) * 16777619u;
+	for (int i = 0; i < NUM_SHOTS; ++i)
+		hash = (hash ^ unsigned(IsAlive(w->shots.pool.alive, i) ? w->shots.x[i] ^ (w->shots.y[i] << 16) : 0)) * 16777619u;
+	for (int i = 0; i < NUM_ENEMIES; ++i)
+		hash = (hash ^ unsigned(IsAlive(w->enemies.pool.alive, i) ? w->enemies.x[i] ^ (w->enemies.y[i] << 16) : 0)) * 16777619u;
+	for (int i = 0; i < NUM_EXPLOSIONS; ++i)
+		hash = (hash ^ unsigned(IsAlive(w->explosions.pool.alive, i) ? int(w->explosions.expire[i] - w->tick) : 0)) * 16777619u;
+	return hash;
 }
 
 // ----------------------------------------------------------------
-void Draw()
+// Without a player we fly up and down shooting all the time
+void HeadlessInput(world* w, unsigned offset)
 {
-	SDL_Rect target;
+	w->up = ((w->tick + offset) / SIM_HZ) % 2;
+	w->down = !w->up;
+	w->fire = true;
+}
 
-	// Scroll and draw all parallax layers --
-	g.scroll += SCROLL_SPEED;
-	for (int i = 0; i < NUM_LAYERS; ++i)
+struct headless_batch
+{
+	world* worlds;
+	int num_worlds;
+	unsigned ticks;
+	const input_tape* replay; // or null to use HeadlessInput()
+};
+
+// Worlds are independent, so each job runs a few of them from start to end
+void StepWorldsJob(void* data, int index)
+{
+	headless_batch* b = (headless_batch*)data;
+	int last = (index + 1) * WORLDS_PER_JOB;
+	CAP(last, 0, b->num_worlds);
+
+	for (int i = index * WORLDS_PER_JOB; i < last; ++i)
 	{
-		parallax* p = &g.layers[i];
-		target = { (-g.scroll * i) % p->width, SCREEN_HEIGHT - p->height, p->width, p->height };
-		SDL_RenderCopy(g.renderer, p->texture, nullptr, &target);
-		target.x += p->width;
-		SDL_RenderCopy(g.renderer, p->texture, nullptr, &target);
+		world* w = &b->worlds[i];
+		tape_reader reader;
+		if (b->replay != nullptr)
+			StartReader(&reader, b->replay);
+
+		for (unsigned tick = 0; tick < b->ticks; ++tick)
+		{
+			if (b->replay == nullptr)
+				HeadlessInput(w, i * 7); // offset a bit so every world plays differently
+			else if (ReplayInput(&reader, w) == false)
+				break;
+
+			UpdateWorld(w);
+		}
 	}
+}
+
+// Step many worlds as fast as possible on a synthetic clock
+void RunHeadless(unsigned ticks, int num_worlds, const input_tape* replay)
+{
+	headless_batch b;
+	b.worlds = (world*)SDL_malloc(sizeof(world) * num_worlds);
+	b.num_worlds = num_worlds;
+	b.ticks = ticks;
+	b.replay = replay;
 
-	// Draw player's ship --
-	if (g.intro_free_timer == 0u || g.frame % 2)
+	for (int i = 0; i < num_worlds; ++i)
+		InitWorld(&b.worlds[i]);
+
+	Uint64 begin = SDL_GetPerformanceCounter();
+	RunJobs(&g.pool, StepWorldsJob, &b, (num_worlds + WORLDS_PER_JOB - 1) / WORLDS_PER_JOB);
+	double seconds = double(SDL_GetPerformanceCounter() - begin) / double(SDL_GetPerformanceFrequency());
+
+	int max_score = 0;
+	unsigned checksum = 0;
+	double total_ticks = 0.0;
+	for (int i = 0; i < num_worlds; ++i)
 	{
-		target = { g.ship_x, g.ship_y, SPRITE_SIZE, SPRITE_SIZE };
-		SDL_RenderCopy(g.renderer, g.ship, nullptr, &target);
+		total_ticks += b.worlds[i].tick - 1;
+		if (b.worlds[i].max_score > max_score)
+			max_score = b.worlds[i].max_score;
+		checksum = checksum * 31u + WorldChecksum(&b.worlds[i]);
 	}
 
-	// Draw lasers --
-	for(int i = 0; i < NUM_SHOTS; ++i)
+	ticks = b.worlds[0].tick - 1; // a replay may end earlier
+	SDL_Log("Headless: %d worlds x %u ticks (%u s of game time) in %.3f s on %d threads, %.0f ticks/s, max score %d, checksum %08x",
+		num_worlds, ticks, ticks / SIM_HZ, seconds, g.pool.num_threads + 1, total_ticks / (seconds > 0.0 ? seconds : 1.0), max_score, checksum);
+
+	SDL_free(b.worlds);
+}
+
+// ----------------------------------------------------------------
+int main(int argc, char* args[])
+{
+	Uint64 launch = SDL_GetPerformanceCounter();
+
+	// Usage: -headless [ticks] -worlds <count> -record <file> -replay <file> -profile <file> -pack -software
+	//        -audio-buffer <samples> -latency-test
+	bool headless = false;
+	unsigned headless_ticks = HEADLESS_TICKS;
+	int num_worlds = 1;
+	const char* record_file = nullptr;
+	const char* replay_file = nullptr;
+	const char* profile_file = nullptr;
+	bool pack = false;
+	for (int i = 1; i < argc; ++i)
 	{
-		if(g.shots[i].alive)
+		if (SDL_strcmp(args[i], "-headless") == 0)
+		{
+			headless = true;
+			if (i + 1 < argc && SDL_atoi(args[i + 1]) > 0)
+				headless_ticks = SDL_atoi(args[++i]);
+		}
+		else if (SDL_strcmp(args[i], "-worlds") == 0 && i + 1 < argc && SDL_atoi(args[i + 1]) > 0)
+			num_worlds = SDL_atoi(args[++i]);
+		else if (SDL_strcmp(args[i], "-record") == 0 && i + 1 < argc)
+			record_file = args[++i];
+		else if (SDL_strcmp(args[i], "-replay") == 0 && i + 1 < argc)
+			replay_file = args[++i];
+		else if (SDL_strcmp(args[i], "-profile") == 0 && i + 1 < argc)
+			profile_file = args[++i];
+		else if (SDL_strcmp(args[i], "-software") == 0)
+			g.software = true;
+		else if (SDL_strcmp(args[i], "-audio-buffer") == 0 && i + 1 < argc)
 		{
-			target = { g.shots[i].x, g.shots[i].y, SPRITE_SIZE, SPRITE_SIZE };
-			SDL_RenderCopy(g.renderer, g.shot, nullptr, &target);
+			int samples = SDL_atoi(args[++i]);
+			if (samples >= 64 && samples <= 8192 && (samples & (samples - 1)) == 0)
+				g.audio.samples = samples;
+			else
+				SDL_Log("Audio buffer must be a power of two from 64 to 8192 samples, using %d", AUDIO_BUFFER);
 		}
+		else if (SDL_strcmp(args[i], "-latency-test") == 0)
+			g.latency.enabled = true;
+		else if (SDL_strcmp(args[i], "-pack") == 0)
+			pack = true;
 	}
 
-	// Draw enemies ---
-	for(int i = 0; i < NUM_ENEMIES; ++i)
+	// Bake the textures offline and quit --
+	if (pack)
 	{
-		if (g.enemies[i].alive)
-		{
-			target = { g.enemies[i].x, g.enemies[i].y, SPRITE_SIZE, SPRITE_SIZE };
-			SDL_RenderCopy(g.renderer, g.tex_enemy, nullptr, &target);
-		}
+		SDL_Init(0);
+		IMG_Init(IMG_INIT_PNG);
+		bool ret = SavePack(PACK_FILE);
+		IMG_Quit();
+		SDL_Quit();
+		return(ret ? 0 : 1);
+	}
+
+	if (profile_file != nullptr)
+	{
+		g.profiler.enabled = PROFILER != 0;
+		g.profiler.file = profile_file;
+		g.profiler.start = launch;
 	}
 
-	// Draw explosions --
-	for(int i = 0; i < NUM_EXPLOSIONS; ++i)
+	Start(headless);
+
+	tape_reader replay;
+	if (replay_file != nullptr)
 	{
-		if(g.explosions[i].alive)
+		if (LoadTape(&g.tape, replay_file) == false)
 		{
-			target = { g.explosions[i].x, g.explosions[i].y, SPRITE_SIZE, SPRITE_SIZE };
-			SDL_Rect section = { SPRITE_SIZE * (g.explosions[i].lifetime/(EXPLOSION_SPEED/5)), 0, SPRITE_SIZE, SPRITE_SIZE };
-			SDL_RenderCopy(g.renderer, g.tex_explosion, &section, &target);
+			SDL_Log("Could not load replay %s", replay_file);
+			Finish();
+			return(1);
 		}
+		StartReader(&replay, &g.tape);
+		record_file = nullptr;
 	}
 
-	// Draw "MAX" label --
-	target = { SCREEN_WIDTH - 20 - g.font.w*8, 10, g.font.w*3, g.font.h };
-	SDL_RenderCopy(g.renderer, g.tex_max, nullptr, &target);
+	if (headless)
+	{
+		RunHeadless(headless_ticks, num_worlds, replay_file ? &g.tape : nullptr);
+		SaveProfile();
+		Finish();
+		return(0);
+	}
 
-	// Draw score numbers
-	DrawNumber(SCREEN_WIDTH -10 -g.font.w*5, 10, g.max_score);
-	DrawNumber(SCREEN_WIDTH -10 -g.font.w*5, 20 + g.font.h, g.score);
-	
-	// Finally swap buffers --
-	SDL_RenderPresent(g.renderer); 
-}
+	// Simulation runs at fixed SIM_HZ steps, rendering goes as fast as vsync allows --
+	Uint64 step = SDL_GetPerformanceFrequency() / SIM_HZ;
+	Uint64 last = SDL_GetPerformanceCounter();
+	Uint64 accumulator = 0;
+	input_state input = {};
 
-// ----------------------------------------------------------------
-int main(int argc, char* args[])
-{
-	Start();
+	// Ticks for next frame run on the simulation thread while this one is drawn from its snapshot --
+	StartSim(&g.sim, replay_file ? &replay : nullptr, record_file ? &g.tape : nullptr);
 
-	while(CheckInput())
+	while(CheckInput(&input))
 	{
-		UpdateWorld(SDL_GetTicks());
-		Draw();
+		Uint64 now = SDL_GetPerformanceCounter();
+		accumulator += now - last;
+		last = now;
+
+		if (accumulator > step * MAX_SIM_STEPS)
+			accumulator = step * MAX_SIM_STEPS;
+
+		int steps = 0;
+		for (; accumulator >= step; accumulator -= step)
+			++steps;
+
+		world_snapshot* snapshot = WaitSim(&g.sim);
+		if (g.sim.finished)
+			break;
+		if (g.latency.enabled && UpdateLatencyTest(&g.latency, &input, now) == false)
+			break;
+
+		KickSim(&g.sim, steps, &input, float(accumulator) / float(step));
+		Draw(snapshot);
+		if (g.frame == 0)
+			SDL_Log("Time to first frame: %.1f ms", double(SDL_GetPerformanceCounter() - launch) * 1000.0 / double(SDL_GetPerformanceFrequency()));
 		++g.frame;
 	}
 
+	StopSim(&g.sim);
+
+	if (record_file != nullptr)
+	{
+		RecordInput(&g.tape, INPUT_QUIT);
+		if (SaveTape(&g.tape, record_file) == false)
+			SDL_Log("Could not save recording %s", record_file);
+	}
+
+	if (g.frame > 0)
+		SDL_Log("Sprites per frame: %.2f submitted, %.2f culled off screen",
+			double(g.sprites.total_submitted) / g.frame, double(g.sprites.total_culled) / g.frame);
+
+	SaveProfile();
 	Finish();
 
 	return(0); // EXIT_SUCCESS